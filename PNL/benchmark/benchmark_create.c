@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FOLDER "./ouichefs" // folder of ouichefs
+#define NB_FILES 1000 // files created by each round
+#define ROUNDS 5 // rounds of creation and removal
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// create NB_FILES files, empty or holding one byte, and flush them to disk
+int create_files(int round, int with_data) {
+    char filename[64];
+    for (int i = 0; i < NB_FILES; i++) {
+        snprintf(filename, sizeof(filename), "%s/test/create_%d_%d", FOLDER, round, i);
+        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            perror("Error creating file");
+            return -1;
+        }
+        if (with_data && write(fd, "a", 1) != 1) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    sync();
+    return 0;
+}
+
+int remove_files(int round) {
+    char filename[64];
+    for (int i = 0; i < NB_FILES; i++) {
+        snprintf(filename, sizeof(filename), "%s/test/create_%d_%d", FOLDER, round, i);
+        if (unlink(filename) == -1) {
+            perror("unlink");
+            return -1;
+        }
+    }
+    sync();
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    int log = -1;
+    double start_time, create_time, remove_time;
+
+    //Create a csv file to store rates only if the name is in arguments
+    if (argc == 2) {
+        log = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (log == -1) {
+            perror("Error creating file");
+            return 2;
+        }
+        dprintf(log, "\"round\",\"with_data\",\"create_per_s\",\"unlink_per_s\"\n");
+    }
+
+    // empty files first (touch), then files of one byte
+    for (int with_data = 0; with_data <= 1; with_data++) {
+        for (int round = 0; round < ROUNDS; round++) {
+            start_time = now();
+            if (create_files(round, with_data) == -1) {
+                return 1;
+            }
+            create_time = now() - start_time;
+
+            start_time = now();
+            if (remove_files(round) == -1) {
+                return 1;
+            }
+            remove_time = now() - start_time;
+
+            double create_rate = NB_FILES / create_time;
+            double remove_rate = NB_FILES / remove_time;
+
+            printf("fichiers %s, tour %d : création %.0f fichiers/s, suppression %.0f fichiers/s\n",
+                with_data ? "d'un octet" : "vides", round, create_rate, remove_rate);
+
+            //update the csv file to store rates
+            if (log != -1) {
+                dprintf(log, "%d,%d,%f,%f\n", round, with_data, create_rate, remove_rate);
+            }
+        }
+    }
+
+    if (log != -1) {
+        close(log);
+    }
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FOLDER "./ouichefs" // folder of ouichefs
+#define OUTPUT "/dev/null" // where the files are copied to
+#define FILESIZE_PACE 512 * 1024 // pace for file size
+#define FILESIZE_STEPS 8 // file sizes tested, the last one capped
+#define FILESIZE_MAX 1024 * 4095 // max file size of every engine (varblock: 1024 blocks of 4095 bytes)
+#define BUFFER_SIZE 64 * 1024 // buffer of the read+write copy
+#define ITERATIONS 20 // copies of each file
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int create_file_with_size(char* filename, int filesize) {
+    char buffer[BUFFER_SIZE];
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("Error creating file");
+        return -1;
+    }
+    memset(buffer, 'a', sizeof(buffer));
+    for (int written = 0; written < filesize; written += sizeof(buffer)) {
+        int len = filesize - written < (int)sizeof(buffer) ?
+            filesize - written : (int)sizeof(buffer);
+        if (write(fd, buffer, len) != len) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// copy the file to out through a userspace buffer
+long copy_read_write(int fd, int out) {
+    char buffer[BUFFER_SIZE];
+    long total = 0;
+    ssize_t len;
+    lseek(fd, 0, SEEK_SET);
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, len) != len) {
+            perror("write");
+            return -1;
+        }
+        total += len;
+    }
+    if (len == -1) {
+        perror("read");
+        return -1;
+    }
+    return total;
+}
+
+// copy the file to out with sendfile (splice of the page cache)
+long copy_sendfile(int fd, int out, int filesize) {
+    off_t offset = 0;
+    long total = 0;
+    ssize_t len;
+    while (total < filesize) {
+        len = sendfile(out, fd, &offset, filesize - total);
+        if (len == -1) {
+            perror("sendfile");
+            return -1;
+        }
+        if (len == 0) {
+            break;
+        }
+        total += len;
+    }
+    return total;
+}
+
+int main(int argc, char** argv) {
+
+    int fd, out, log = -1;
+    double start_time, rw_time, sendfile_time;
+
+    //Create a csv file to store throughputs only if the name is in arguments
+    if (argc == 2) {
+        log = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (log == -1) {
+            perror("Error creating file");
+            return 2;
+        }
+        dprintf(log, "\"filesize\",\"read_write_mbps\",\"sendfile_mbps\"\n");
+    }
+
+    out = open(OUTPUT, O_WRONLY);
+    if (out == -1) {
+        perror("Error opening output");
+        return 2;
+    }
+
+    for (int step = 1; step <= FILESIZE_STEPS; step++) {
+        int filesize = step * FILESIZE_PACE;
+        char filename[64];
+        if (filesize > FILESIZE_MAX) {
+            filesize = FILESIZE_MAX;
+        }
+        snprintf(filename, sizeof(filename), "%s/test/sendfile_%d", FOLDER, filesize);
+
+        if (create_file_with_size(filename, filesize) == -1) {
+            return 1;
+        }
+        fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+            perror("Error opening file");
+            return 1;
+        }
+
+        // bring the file in the page cache before timing
+        if (copy_read_write(fd, out) != filesize) {
+            return 1;
+        }
+
+        start_time = now();
+        for (int i = 0; i < ITERATIONS; i++) {
+            if (copy_read_write(fd, out) != filesize) {
+                return 1;
+            }
+        }
+        rw_time = now() - start_time;
+
+        start_time = now();
+        for (int i = 0; i < ITERATIONS; i++) {
+            if (copy_sendfile(fd, out, filesize) != filesize) {
+                return 1;
+            }
+        }
+        sendfile_time = now() - start_time;
+        close(fd);
+
+        double rw_mbps = (double)filesize * ITERATIONS / rw_time / (1024 * 1024);
+        double sendfile_mbps = (double)filesize * ITERATIONS / sendfile_time / (1024 * 1024);
+
+        printf("taille fichier : %d, read+write : %.1f Mo/s, sendfile : %.1f Mo/s\n",
+            filesize, rw_mbps, sendfile_mbps);
+
+        //update the csv file to store throughputs
+        if (log != -1) {
+            dprintf(log, "%d,%f,%f\n", filesize, rw_mbps, sendfile_mbps);
+        }
+    }
+
+    close(out);
+    if (log != -1) {
+        close(log);
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "ioctl.h"
+
+static const char *algos[] = { "none", "lz4", "zstd" };
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <file_path> [none|lz4|zstd]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *file_path = argv[1];
+    int fd = open(file_path, argc == 3 ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("Error : opening file");
+        return EXIT_FAILURE;
+    }
+
+    int algo;
+    if (argc == 3) {
+        for (algo = OUICHEFS_COMPRESS_NONE; algo <= OUICHEFS_COMPRESS_ZSTD; algo++)
+            if (!strcmp(argv[2], algos[algo]))
+                break;
+        if (algo > OUICHEFS_COMPRESS_ZSTD) {
+            fprintf(stderr, "Unknown algorithm : %s\n", argv[2]);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        if (ioctl(fd, SET_COMPRESS, &algo) == -1)
+            perror("\n");
+    }
+
+    if (ioctl(fd, GET_COMPRESS, &algo) == -1)
+        perror("\n");
+    else
+        printf("COMPRESS : %s\n", algos[algo]);
+
+    close(fd);
+    return 0;
+}
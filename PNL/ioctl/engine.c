@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "ioctl.h"
+
+static const char *engines[] = { "default", "pagecache", "direct", "varblock" };
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <file_path> [pagecache|direct|varblock]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *file_path = argv[1];
+    int fd = open(file_path, argc == 3 ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("Error : opening file");
+        return EXIT_FAILURE;
+    }
+
+    int engine;
+    if (argc == 3) {
+        for (engine = OUICHEFS_ENGINE_PAGECACHE; engine <= OUICHEFS_ENGINE_VARBLOCK; engine++)
+            if (!strcmp(argv[2], engines[engine]))
+                break;
+        if (engine > OUICHEFS_ENGINE_VARBLOCK) {
+            fprintf(stderr, "Unknown engine : %s\n", argv[2]);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        if (ioctl(fd, SET_ENGINE, &engine) == -1)
+            perror("\n");
+    }
+
+    if (ioctl(fd, GET_ENGINE, &engine) == -1)
+        perror("\n");
+    else
+        printf("ENGINE : %s\n", engines[engine]);
+
+    close(fd);
+    return 0;
+}
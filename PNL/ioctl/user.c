@@ -33,6 +33,9 @@ int main(int argc, char *argv[]) {
     if(ioctl(fd, INTERNAL_FRAG, buf) == -1)
         perror("\n");
     printf("INTERNAL_FRAG : %s\n", buf);
+    if(ioctl(fd, SPLIT_COUNT, buf) == -1)
+        perror("\n");
+    printf("SPLIT_COUNT : %s\n", buf);
     if(ioctl(fd, USED_BLOCKS_INFO, buf) == -1)
         perror("\n");
 
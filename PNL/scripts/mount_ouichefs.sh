@@ -1,7 +1,10 @@
 #!/bin/bash
 
+# I/O engine of new files: pagecache (default), direct or varblock
+engine=${1:-pagecache}
+
 insmod /share/ouichefs.ko && 
-mount /share/test.img ~/ouichefs && 
+mount -o engine=$engine /share/test.img ~/ouichefs && 
 cd ~/ouichefs && 
 stat -f -c %T .
 rm -rf test
@@ -10,6 +10,41 @@
 #include <linux/bitmap.h>
 #include "ouichefs.h"
 
+#define OUICHEFS_BITS_PER_BLOCK (OUICHEFS_BLOCK_SIZE * 8)
+
+/*
+ * Note that the nr on-disk bitmap blocks from the i-th one, counted from the
+ * first inode free bitmap block, change with the running transaction, so that
+ * the journal keeps room for the commit to log them. Called with bitmap_lock
+ * held.
+ */
+static inline void map_dirty(struct ouichefs_sb_info *sbi, uint32_t i,
+			     uint32_t nr)
+{
+	for (; nr; i++, nr--)
+		if (!__test_and_set_bit(i, sbi->j_map))
+			WRITE_ONCE(sbi->j_map_nr, sbi->j_map_nr + 1);
+}
+
+static inline void ifree_dirty(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	map_dirty(sbi, ino / OUICHEFS_BITS_PER_BLOCK, 1);
+}
+
+static inline void bfree_dirty(struct ouichefs_sb_info *sbi, uint32_t bno,
+			       uint32_t nr)
+{
+	map_dirty(sbi, sbi->nr_ifree_blocks + bno / OUICHEFS_BITS_PER_BLOCK,
+		  (bno + nr - 1) / OUICHEFS_BITS_PER_BLOCK -
+			  bno / OUICHEFS_BITS_PER_BLOCK + 1);
+}
+
+static inline void bref_dirty(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	map_dirty(sbi, sbi->nr_ifree_blocks + sbi->nr_bfree_blocks +
+			       bno / OUICHEFS_BLOCK_SIZE, 1);
+}
+
 /*
  * Return the first free bit (set to 1) in a given in-memory bitmap spanning
  * over multiple blocks and clear it.
@@ -32,36 +67,132 @@ static inline uint32_t get_first_free_bit(unsigned long *freemap,
 }
 
 /*
- * Return an unused inode number and mark it used.
+ * Same as get_first_free_bit(), but look for the first free bit from goal on,
+ * and only then from the start of the bitmap.
+ */
+static inline uint32_t get_free_bit_near(unsigned long *freemap,
+					 unsigned long size, uint32_t goal)
+{
+	uint32_t bit;
+
+	bit = find_next_bit(freemap, size, goal);
+	if (bit >= size)
+		return get_first_free_bit(freemap, size);
+
+	bitmap_clear(freemap, bit, 1);
+
+	return bit;
+}
+
+/*
+ * The helpers below take sbi->bitmap_lock: page faults and writeback allocate
+ * blocks without the inode lock of the file, and files are freed concurrently.
+ */
+
+/*
+ * Return an unused inode number, the first one from goal on if any, and mark it
+ * used. The goal is ignored by the alloc=first policy.
  * Return 0 if no free inode was found.
  */
-static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
 	uint32_t ret;
 
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
+	if (sbi->alloc == OUICHEFS_ALLOC_FIRST)
+		goal = 0;
+	spin_lock(&sbi->bitmap_lock);
+	ret = get_free_bit_near(sbi->ifree_bitmap, sbi->nr_inodes, goal);
 	if (ret) {
 		sbi->nr_free_inodes--;
+		ifree_dirty(sbi, ret);
+	}
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
 			 ret);
-	}
 	return ret;
 }
 
 /*
- * Return an unused block number and mark it used.
+ * Return an unused block number, the first one from goal on if any, and mark it
+ * used. Files pass their index block as goal, so that their blocks follow it.
+ * The goal is ignored by the alloc=first policy.
  * Return 0 if no free block was found.
  */
-static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
 	uint32_t ret;
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
+	if (sbi->alloc == OUICHEFS_ALLOC_FIRST)
+		goal = 0;
+	spin_lock(&sbi->bitmap_lock);
+	ret = get_free_bit_near(sbi->bfree_bitmap, sbi->nr_blocks, goal);
 	if (ret) {
 		sbi->nr_free_blocks--;
+		bfree_dirty(sbi, ret, 1);
+	}
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
 			 ret);
+	return ret;
+}
+
+/*
+ * Give back a block just taken by get_free_block() that nothing points to, not
+ * even the committed metadata: unlike put_block(), it is free again at once.
+ */
+static inline void put_unused_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	spin_lock(&sbi->bitmap_lock);
+	bitmap_set(sbi->bfree_bitmap, bno, 1);
+	sbi->nr_free_blocks++;
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+static inline uint32_t __find_free_run(struct ouichefs_sb_info *sbi,
+				       uint32_t goal, uint32_t nr)
+{
+	unsigned long start, end;
+	bool wrapped = false;
+
+	if (sbi->alloc == OUICHEFS_ALLOC_FIRST)
+		goal = 0;
+	end = goal;
+	for (;;) {
+		start = find_next_bit(sbi->bfree_bitmap, sbi->nr_blocks, end);
+		if (wrapped && start >= goal)
+			return 0;
+		if (start >= sbi->nr_blocks) {
+			if (wrapped || !goal)
+				return 0;
+			wrapped = true;
+			end = 0;
+			continue;
+		}
+		end = find_next_zero_bit(sbi->bfree_bitmap, sbi->nr_blocks,
+					 start);
+		if (end - start >= nr)
+			return start;
 	}
+}
+
+/*
+ * Return the first block of a run of nr unused blocks, looking from goal on and
+ * then from the start of the partition, without marking it used.
+ * Return 0 if there is no such run.
+ */
+static inline uint32_t find_free_run(struct ouichefs_sb_info *sbi,
+				     uint32_t goal, uint32_t nr)
+{
+	uint32_t ret;
+
+	spin_lock(&sbi->bitmap_lock);
+	ret = __find_free_run(sbi, goal, nr);
+	spin_unlock(&sbi->bitmap_lock);
+
 	return ret;
 }
 
@@ -85,23 +216,149 @@ static inline int put_free_bit(unsigned long *freemap, unsigned long size,
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
+	spin_lock(&sbi->bitmap_lock);
+	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino)) {
+		spin_unlock(&sbi->bitmap_lock);
 		return;
-
+	}
 	sbi->nr_free_inodes++;
+	ifree_dirty(sbi, ino);
+	spin_unlock(&sbi->bitmap_lock);
 	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
 }
 
 /*
- * Mark a block as unused.
+ * Return true if block bno is shared by several files.
+ */
+static inline bool is_block_shared(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	return sbi->bref_map && bno < sbi->nr_blocks && sbi->bref_map[bno];
+}
+
+/*
+ * Take a reference on block bno for one more file sharing it.
+ * Return -EMLINK if the block already has as many as the map can count.
+ */
+static inline int get_block_ref(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	int ret = 0;
+
+	spin_lock(&sbi->bitmap_lock);
+	if (sbi->bref_map[bno] == OUICHEFS_BREF_MAX) {
+		ret = -EMLINK;
+	} else {
+		sbi->bref_map[bno]++;
+		bref_dirty(sbi, bno);
+	}
+	spin_unlock(&sbi->bitmap_lock);
+
+	return ret;
+}
+
+/*
+ * Mark a block as unused. A shared block only loses a reference.
+ * The block is only free again once the transaction freeing it is committed:
+ * until then, the committed metadata may still point to it.
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+	spin_lock(&sbi->bitmap_lock);
+	if (is_block_shared(sbi, bno)) {
+		sbi->bref_map[bno]--;
+		bref_dirty(sbi, bno);
+		spin_unlock(&sbi->bitmap_lock);
 		return;
-
-	sbi->nr_free_blocks++;
+	}
+	if (put_free_bit(sbi->bfree_pending, sbi->nr_blocks, bno)) {
+		spin_unlock(&sbi->bitmap_lock);
+		return;
+	}
+	sbi->nr_pending_blocks++;
+	bfree_dirty(sbi, bno, 1);
+	spin_unlock(&sbi->bitmap_lock);
 	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
 }
 
+/* Called with sbi->bitmap_lock held */
+static inline void __put_blocks(struct ouichefs_sb_info *sbi, uint32_t bno,
+				uint32_t nr)
+{
+	if (!nr)
+		return;
+
+	bitmap_set(sbi->bfree_pending, bno, nr);
+	sbi->nr_pending_blocks += nr;
+	bfree_dirty(sbi, bno, nr);
+	pr_debug("%s:%d: freed blocks %u-%u\n", __func__, __LINE__, bno,
+		 bno + nr - 1);
+}
+
+/*
+ * Mark the nr contiguous blocks starting at bno as unused. Shared blocks only
+ * lose a reference, the others are freed with one bitmap operation per run.
+ */
+static inline void put_blocks(struct ouichefs_sb_info *sbi, uint32_t bno,
+			      uint32_t nr)
+{
+	uint32_t i, start = bno;
+
+	if (bno + nr > sbi->nr_blocks)
+		return;
+
+	spin_lock(&sbi->bitmap_lock);
+	for (i = bno; sbi->bref_map && i < bno + nr; i++) {
+		if (!sbi->bref_map[i])
+			continue;
+		sbi->bref_map[i]--;
+		bref_dirty(sbi, i);
+		__put_blocks(sbi, start, i - start);
+		start = i + 1;
+	}
+	__put_blocks(sbi, start, bno + nr - start);
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * Add block bno to the run of contiguous blocks [*start, *start + *len) being
+ * freed. The run is marked unused as soon as bno does not extend it, and a bno
+ * of 0 just flushes it.
+ */
+static inline void put_block_run(struct ouichefs_sb_info *sbi,
+				 uint32_t *start, uint32_t *len, uint32_t bno)
+{
+	if (bno && *len && bno == *start + *len) {
+		(*len)++;
+		return;
+	}
+	if (*len)
+		put_blocks(sbi, *start, *len);
+	*start = bno;
+	*len = bno ? 1 : 0;
+}
+
+/*
+ * Mark the blocks referenced by nr entries of a file index as unused and clear
+ * the entries. mask extracts the block number from an entry. Runs of
+ * contiguous blocks are freed with a single bitmap operation.
+ * Return the number of blocks freed.
+ */
+static inline uint32_t put_index_blocks(struct ouichefs_sb_info *sbi,
+					uint32_t *entries, uint32_t nr,
+					uint32_t mask)
+{
+	uint32_t i, bno, start = 0, len = 0, freed = 0;
+
+	for (i = 0; i < nr; i++) {
+		bno = entries[i] & mask;
+		entries[i] = 0;
+		if (!bno)
+			continue;
+		freed++;
+		put_block_run(sbi, &start, &len, bno);
+	}
+	put_block_run(sbi, &start, &len, 0);
+
+	return freed;
+}
+
 #endif /* _OUICHEFS_BITMAP_H */
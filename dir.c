@@ -10,33 +10,1060 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/shrinker.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
+
+/* readdir position past the last file, see ouichefs_dir_pos() */
+#define OUICHEFS_DIR_END ((loff_t)1 << 40)
+
+/*
+ * Hash of a file name (32-bit FNV-1a). It is stored in directory leaves and
+ * locates them, so it must never change.
+ */
+uint32_t ouichefs_name_hash(const char *name, unsigned int len)
+{
+	uint32_t hash = 2166136261U;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Record of the i-th file of the table of dblock */
+static inline struct ouichefs_file *
+ouichefs_dir_file(struct ouichefs_dir_block *dblock, int i)
+{
+	return (struct ouichefs_file *)((char *)dblock +
+					dblock->entries[i].offset);
+}
+
+/* Free bytes between the table and the heap of dblock */
+static inline int ouichefs_dir_room(struct ouichefs_dir_block *dblock)
+{
+	return OUICHEFS_BLOCK_SIZE - sizeof(struct ouichefs_dir_block) -
+	       dblock->nr_entries * sizeof(struct ouichefs_dir_entry) -
+	       dblock->heap_size;
+}
+
+static inline bool ouichefs_dir_tomb(struct ouichefs_dir_block *dblock, int i)
+{
+	return !dblock->entries[i].offset;
+}
+
+/*
+ * Return the position in the table of dblock of the first entry whose hash is
+ * greater than hash if after is set, not lower than hash otherwise.
+ */
+static int ouichefs_dir_search(struct ouichefs_dir_block *dblock,
+			       uint32_t hash, bool after)
+{
+	int lo = 0, hi = dblock->nr_entries, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dblock->entries[mid].hash < hash ||
+		    (after && dblock->entries[mid].hash == hash))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Return the position in the table of dblock of the file named name, whose
+ * hash is hash, or -1 if there is none. Only files with the same hash are
+ * compared.
+ */
+static int ouichefs_dir_find(struct ouichefs_dir_block *dblock,
+			     const struct qstr *name, uint32_t hash)
+{
+	struct ouichefs_file *f;
+	int i;
+
+	for (i = ouichefs_dir_search(dblock, hash, false);
+	     i < dblock->nr_entries; i++) {
+		if (dblock->entries[i].hash != hash)
+			break;
+		if (ouichefs_dir_tomb(dblock, i))
+			continue;
+		f = ouichefs_dir_file(dblock, i);
+		if (f->name_len == name->len &&
+		    !memcmp(f->filename, name->name, name->len))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Insert the file name with inode number ino, file type type (FT_*) and name
+ * hash hash in dblock, which must have room for its entry and record. The file
+ * goes after those with the same hash, so that their readdir positions do not
+ * change, and takes the place of a tombstone found there if that does not
+ * change the positions of other files either.
+ */
+static void ouichefs_dir_insert(struct ouichefs_dir_block *dblock,
+				uint32_t hash, const char *name,
+				unsigned int len, uint32_t ino, uint8_t type)
+{
+	int i = ouichefs_dir_search(dblock, hash, true);
+	struct ouichefs_dir_entry *e;
+	struct ouichefs_file *f;
+
+	if (i > 0 && ouichefs_dir_tomb(dblock, i - 1)) {
+		i--;
+		dblock->dead_size -= sizeof(*e);
+	} else if (i < dblock->nr_entries && ouichefs_dir_tomb(dblock, i) &&
+		   (i + 1 == dblock->nr_entries ||
+		    dblock->entries[i + 1].hash != dblock->entries[i].hash)) {
+		dblock->dead_size -= sizeof(*e);
+	} else {
+		memmove(dblock->entries + i + 1, dblock->entries + i,
+			(dblock->nr_entries - i) * sizeof(*e));
+		dblock->nr_entries++;
+	}
+	dblock->nr_files++;
+
+	e = &dblock->entries[i];
+	dblock->heap_size += OUICHEFS_FILE_SIZE(len);
+	e->hash = hash;
+	e->offset = OUICHEFS_BLOCK_SIZE - dblock->heap_size;
+	e->size = OUICHEFS_FILE_SIZE(len);
+
+	f = ouichefs_dir_file(dblock, i);
+	memset(f, 0, e->size);
+	f->inode = ino;
+	f->name_len = len;
+	f->file_type = type;
+	memcpy(f->filename, name, len);
+}
+
+/* Append the i-th file of src to the table of dst */
+static void ouichefs_dir_copy(struct ouichefs_dir_block *dst,
+			      struct ouichefs_dir_block *src, int i)
+{
+	struct ouichefs_file *f = ouichefs_dir_file(src, i);
+
+	ouichefs_dir_insert(dst, src->entries[i].hash, f->filename,
+			    f->name_len, f->inode, f->file_type);
+}
+
+/*
+ * Move the files of dblock whose hash has bit set to new, or rewrite them all
+ * in dblock if new is NULL. Either way, tombstones and the records of removed
+ * files are dropped from dblock. buf is a block-sized scratch buffer.
+ */
+static void ouichefs_dir_rebuild(struct ouichefs_dir_block *dblock,
+				 struct ouichefs_dir_block *new, uint32_t bit,
+				 void *buf)
+{
+	struct ouichefs_dir_block *old = buf;
+	int i;
+
+	memcpy(old, dblock, OUICHEFS_BLOCK_SIZE);
+	memset(dblock, 0, OUICHEFS_BLOCK_SIZE);
+	dblock->depth = old->depth;
+
+	for (i = 0; i < old->nr_entries; i++) {
+		if (ouichefs_dir_tomb(old, i))
+			continue;
+		if (new && (old->entries[i].hash & bit))
+			ouichefs_dir_copy(new, old, i);
+		else
+			ouichefs_dir_copy(dblock, old, i);
+	}
+}
+
+/*
+ * readdir position of a file: its name hash, and its rank k among the entries
+ * of its leaf with the same hash, tombstones included. Splits keep the files of
+ * a leaf sorted by hash, so positions stay valid as the directory grows and
+ * shrinks. Only compacting a leaf can change k, of files whose hash collides
+ * with a removed one. 0 and 1 are . and ..
+ */
+static inline loff_t ouichefs_dir_pos(uint32_t hash, unsigned int k)
+{
+	return 2 + (((loff_t)hash << 8) | k);
+}
+
+/* Entry of the leaf table pointing to the leaf holding hash */
+static inline uint32_t ouichefs_dir_idx(struct ouichefs_dir_index *dindex,
+					uint32_t hash)
+{
+	return dindex->depth ? hash >> (32 - dindex->depth) : 0;
+}
+
+/*
+ * Read the leaf at entry idx of the leaf table of dindex, which must have at
+ * least one leaf.
+ */
+static struct buffer_head *ouichefs_dir_read_leaf(struct super_block *sb,
+						  struct ouichefs_dir_index *dindex,
+						  uint32_t idx)
+{
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	bh = sb_bread(sb, dindex->blocks[idx / OUICHEFS_DIR_PTRS]);
+	if (!bh)
+		return NULL;
+	bno = ((uint32_t *)bh->b_data)[idx % OUICHEFS_DIR_PTRS];
+	brelse(bh);
+
+	return sb_bread(sb, bno);
+}
+
+/* Entry of the leaf table past those pointing to dblock, found at entry idx */
+static inline uint32_t ouichefs_dir_next_leaf(struct ouichefs_dir_index *dindex,
+					      struct ouichefs_dir_block *dblock,
+					      uint32_t idx)
+{
+	int depth = min_t(int, dblock->depth, dindex->depth);
+	uint32_t span = 1U << (dindex->depth - depth);
+
+	return (idx & ~(span - 1)) + span;
+}
+
+/* Point the entries [from, to) of the leaf table of dindex to block bno */
+static int ouichefs_dir_set_ptrs(struct super_block *sb,
+				 struct ouichefs_dir_index *dindex,
+				 uint32_t from, uint32_t to, uint32_t bno)
+{
+	struct buffer_head *bh;
+	uint32_t *ptrs;
+
+	while (from < to) {
+		bh = sb_bread(sb, dindex->blocks[from / OUICHEFS_DIR_PTRS]);
+		if (!bh)
+			return -EIO;
+		ptrs = (uint32_t *)bh->b_data;
+		do {
+			ptrs[from % OUICHEFS_DIR_PTRS] = bno;
+			from++;
+		} while (from < to && from % OUICHEFS_DIR_PTRS);
+		ouichefs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+/* Allocate a zeroed block for dir, in the running transaction */
+static struct buffer_head *ouichefs_dir_new_block(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	bno = get_free_block(sbi, OUICHEFS_INODE(dir)->index_block);
+	if (!bno)
+		return ERR_PTR(-ENOSPC);
+	bh = ouichefs_new_block(sb, bno);
+	if (!bh) {
+		put_unused_block(sbi, bno);
+		return ERR_PTR(-ENOMEM);
+	}
+	ouichefs_journal_dirty(sb, bh);
+
+	dir->i_blocks++;
+	dir->i_size += OUICHEFS_BLOCK_SIZE;
+
+	return bh;
+}
+
+static void ouichefs_dir_put_block(struct inode *dir, uint32_t bno)
+{
+	put_block(OUICHEFS_SB(dir->i_sb), bno);
+	dir->i_blocks--;
+	dir->i_size -= OUICHEFS_BLOCK_SIZE;
+}
+
+/* Give the empty directory dir its first pointer block and leaf */
+static int ouichefs_dir_init(struct inode *dir,
+			     struct ouichefs_dir_index *dindex)
+{
+	struct buffer_head *bh_ptrs, *bh_leaf;
+
+	bh_ptrs = ouichefs_dir_new_block(dir);
+	if (IS_ERR(bh_ptrs))
+		return PTR_ERR(bh_ptrs);
+	bh_leaf = ouichefs_dir_new_block(dir);
+	if (IS_ERR(bh_leaf)) {
+		ouichefs_dir_put_block(dir, bh_ptrs->b_blocknr);
+		brelse(bh_ptrs);
+		return PTR_ERR(bh_leaf);
+	}
+
+	((uint32_t *)bh_ptrs->b_data)[0] = bh_leaf->b_blocknr;
+	dindex->depth = 0;
+	dindex->blocks[0] = bh_ptrs->b_blocknr;
+	brelse(bh_leaf);
+	brelse(bh_ptrs);
+
+	return 0;
+}
+
+/*
+ * Double the leaf table of dir: entry i becomes entries 2i and 2i + 1, so that
+ * every leaf is pointed to by twice as many entries.
+ */
+static int ouichefs_dir_grow(struct inode *dir,
+			     struct ouichefs_dir_index *dindex)
+{
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh;
+	uint32_t n = 1U << dindex->depth, nr_old, nr_new, b, i;
+	uint32_t *ptrs;
+	int ret = 0;
+
+	if (dindex->depth >= OUICHEFS_DIR_MAX_DEPTH)
+		return -EMLINK;
+	nr_old = DIV_ROUND_UP(n, OUICHEFS_DIR_PTRS);
+	nr_new = DIV_ROUND_UP(2 * n, OUICHEFS_DIR_PTRS);
+
+	/* every pointer block is rewritten, and the new ones allocated */
+	ret = ouichefs_journal_extend(sb, 2 * nr_new - nr_old);
+	if (ret)
+		return ret;
+
+	ptrs = kvmalloc_array(n, sizeof(uint32_t), GFP_KERNEL);
+	if (!ptrs)
+		return -ENOMEM;
+	for (b = 0; b < nr_old; b++) {
+		bh = sb_bread(sb, dindex->blocks[b]);
+		if (!bh) {
+			ret = -EIO;
+			goto free;
+		}
+		memcpy(ptrs + b * OUICHEFS_DIR_PTRS, bh->b_data,
+		       min_t(uint32_t, n - b * OUICHEFS_DIR_PTRS,
+			     OUICHEFS_DIR_PTRS) * sizeof(uint32_t));
+		brelse(bh);
+	}
+
+	/* Allocate the new pointer blocks before touching the table */
+	for (b = nr_old; b < nr_new; b++) {
+		bh = ouichefs_dir_new_block(dir);
+		if (IS_ERR(bh)) {
+			ret = PTR_ERR(bh);
+			goto put;
+		}
+		dindex->blocks[b] = bh->b_blocknr;
+		brelse(bh);
+	}
+
+	for (b = 0; b < nr_new; b++) {
+		bh = sb_bread(sb, dindex->blocks[b]);
+		if (!bh) {
+			ret = -EIO;
+			goto free;
+		}
+		for (i = 0; i < min_t(uint32_t, 2 * n - b * OUICHEFS_DIR_PTRS,
+				      OUICHEFS_DIR_PTRS); i++)
+			((uint32_t *)bh->b_data)[i] =
+				ptrs[(b * OUICHEFS_DIR_PTRS + i) / 2];
+		ouichefs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+	dindex->depth++;
+	goto free;
+
+put:
+	while (b-- > nr_old) {
+		ouichefs_dir_put_block(dir, dindex->blocks[b]);
+		dindex->blocks[b] = 0;
+	}
+free:
+	kvfree(ptrs);
+	return ret;
+}
+
+/*
+ * Split the leaf bh, found at entry idx of the leaf table of dir, by moving the
+ * files whose hash has the bit following the common prefix set to a new leaf.
+ * The local depth of the leaf must be lower than the global depth.
+ */
+static int ouichefs_dir_split(struct inode *dir,
+			      struct ouichefs_dir_index *dindex,
+			      struct buffer_head *bh, uint32_t idx, void *buf)
+{
+	struct ouichefs_dir_block *old = (struct ouichefs_dir_block *)bh->b_data;
+	struct ouichefs_dir_block *new;
+	struct buffer_head *bh_new;
+	uint32_t span = 1U << (dindex->depth - old->depth);
+	int ret;
+
+	/* both leaves, the bitmap block of the new one, its pointer blocks */
+	ret = ouichefs_journal_extend(dir->i_sb,
+				      3 + DIV_ROUND_UP(span / 2,
+						       OUICHEFS_DIR_PTRS));
+	if (ret)
+		return ret;
+
+	bh_new = ouichefs_dir_new_block(dir);
+	if (IS_ERR(bh_new))
+		return PTR_ERR(bh_new);
+	new = (struct ouichefs_dir_block *)bh_new->b_data;
+
+	/* Both leaves keep their files sorted by hash */
+	ouichefs_dir_rebuild(old, new, 1U << (31 - old->depth), buf);
+	old->depth++;
+	new->depth = old->depth;
+	ouichefs_journal_dirty(dir->i_sb, bh);
+
+	/* The new leaf takes the upper half of the entries of the old one */
+	idx &= ~(span - 1);
+	ret = ouichefs_dir_set_ptrs(dir->i_sb, dindex, idx + span / 2,
+				    idx + span, bh_new->b_blocknr);
+	brelse(bh_new);
+
+	return ret;
+}
+
+/*
+ * In-memory name cache of a directory, built from its leaves by the first
+ * lookup and kept up to date by ouichefs_dir_add() and ouichefs_dir_remove().
+ * Lookups, even of missing names, then read no block. It is protected by the
+ * i_rwsem of the directory for writing, and by RCU for reading since the
+ * shrinker may release it at any time, oldest cache first. Directories with
+ * more than dir_cache_max files (mount option) are not cached.
+ */
+struct ouichefs_dir_cache {
+	struct rhltable names; /* Of struct ouichefs_dir_name, by hash */
+	unsigned int nr_names;
+	struct list_head lru; /* In ouichefs_dir_caches */
+	struct ouichefs_inode_info *ci; /* Directory owning the cache */
+};
+
+struct ouichefs_dir_name {
+	struct rhlist_head node;
+	uint32_t hash; /* ouichefs_name_hash() of name */
+	uint32_t ino;
+	uint8_t type; /* FT_* */
+	uint8_t len;
+	struct rcu_head rcu;
+	char name[];
+};
+
+static const struct rhashtable_params ouichefs_dir_cache_params = {
+	.key_len = sizeof(uint32_t),
+	.key_offset = offsetof(struct ouichefs_dir_name, hash),
+	.head_offset = offsetof(struct ouichefs_dir_name, node),
+	.automatic_shrinking = true,
+};
+
+/* Caches of all directories, oldest first */
+static LIST_HEAD(ouichefs_dir_caches);
+static DEFINE_SPINLOCK(ouichefs_dir_caches_lock);
+static unsigned long ouichefs_nr_dir_caches;
+
+static struct ouichefs_dir_name *ouichefs_dir_name_alloc(uint32_t hash,
+							 const char *name,
+							 unsigned int len,
+							 uint32_t ino,
+							 uint8_t type)
+{
+	struct ouichefs_dir_name *dn;
+
+	dn = kmalloc(struct_size(dn, name, len), GFP_NOFS);
+	if (!dn)
+		return NULL;
+	dn->hash = hash;
+	dn->ino = ino;
+	dn->type = type;
+	dn->len = len;
+	memcpy(dn->name, name, len);
+
+	return dn;
+}
+
+static void ouichefs_dir_name_free(void *ptr, void *arg)
+{
+	kfree(ptr);
+}
+
+static int ouichefs_dir_cache_insert(struct ouichefs_dir_cache *cache,
+				     struct ouichefs_dir_name *dn)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(cache->ci->vfs_inode.i_sb);
+	int ret;
+
+	if (cache->nr_names >= sbi->dir_cache_max)
+		return -E2BIG;
+	ret = rhltable_insert(&cache->names, &dn->node,
+			      ouichefs_dir_cache_params);
+	if (!ret)
+		cache->nr_names++;
+
+	return ret;
+}
+
+/* Must be called under rcu_read_lock() */
+static struct ouichefs_dir_name *
+ouichefs_dir_cache_find(struct ouichefs_dir_cache *cache, uint32_t hash,
+			const struct qstr *name)
+{
+	struct ouichefs_dir_name *dn;
+	struct rhlist_head *list, *pos;
+
+	list = rhltable_lookup(&cache->names, &hash, ouichefs_dir_cache_params);
+	rhl_for_each_entry_rcu(dn, pos, list, node)
+		if (dn->len == name->len &&
+		    !memcmp(dn->name, name->name, name->len))
+			return dn;
+
+	return NULL;
+}
+
+static void ouichefs_dir_cache_destroy(struct ouichefs_dir_cache *cache)
+{
+	rhltable_free_and_destroy(&cache->names, ouichefs_dir_name_free, NULL);
+	kfree(cache);
+}
+
+/*
+ * Detach the cache of ci, if any, and return it. Readers may still use it until
+ * the end of an RCU grace period.
+ */
+static struct ouichefs_dir_cache *
+ouichefs_dir_cache_detach(struct ouichefs_inode_info *ci)
+{
+	struct ouichefs_dir_cache *cache;
+
+	if (!rcu_access_pointer(ci->dir_cache))
+		return NULL;
+
+	spin_lock(&ouichefs_dir_caches_lock);
+	cache = rcu_dereference_protected(ci->dir_cache,
+					  lockdep_is_held(&ouichefs_dir_caches_lock));
+	if (cache) {
+		RCU_INIT_POINTER(ci->dir_cache, NULL);
+		list_del(&cache->lru);
+		ouichefs_nr_dir_caches--;
+	}
+	spin_unlock(&ouichefs_dir_caches_lock);
+
+	return cache;
+}
+
+/* Drop the cache of ci, which could not be kept up to date */
+static void ouichefs_dir_cache_drop(struct ouichefs_inode_info *ci)
+{
+	struct ouichefs_dir_cache *cache = ouichefs_dir_cache_detach(ci);
+
+	if (!cache)
+		return;
+	synchronize_rcu();
+	ouichefs_dir_cache_destroy(cache);
+}
+
+/* Release the cache of dir, which is being destroyed and has no reader left */
+void ouichefs_dir_cache_release(struct inode *dir)
+{
+	struct ouichefs_dir_cache *cache;
+
+	cache = ouichefs_dir_cache_detach(OUICHEFS_INODE(dir));
+	if (cache)
+		ouichefs_dir_cache_destroy(cache);
+}
+
+/*
+ * Build the cache of dir from its leaves and attach it, unless dir is too large
+ * or another lookup did it first. dindex is the index block of dir.
+ */
+static void ouichefs_dir_cache_build(struct inode *dir,
+				     struct ouichefs_dir_index *dindex)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_cache *cache;
+	struct ouichefs_dir_block *dblock;
+	struct ouichefs_dir_name *dn;
+	struct ouichefs_file *f;
+	struct buffer_head *bh;
+	uint32_t idx = 0;
+	int i;
+
+	if (dindex->nr_files > sbi->dir_cache_max)
+		return;
+	cache = kzalloc(sizeof(*cache), GFP_NOFS);
+	if (!cache)
+		return;
+	if (rhltable_init(&cache->names, &ouichefs_dir_cache_params)) {
+		kfree(cache);
+		return;
+	}
+	cache->ci = ci;
+
+	while (dindex->blocks[0] && idx < (1U << dindex->depth)) {
+		bh = ouichefs_dir_read_leaf(sb, dindex, idx);
+		if (!bh)
+			goto destroy;
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		for (i = 0; i < dblock->nr_entries; i++) {
+			if (ouichefs_dir_tomb(dblock, i))
+				continue;
+			f = ouichefs_dir_file(dblock, i);
+			dn = ouichefs_dir_name_alloc(dblock->entries[i].hash,
+						     f->filename, f->name_len,
+						     f->inode, f->file_type);
+			if (!dn || ouichefs_dir_cache_insert(cache, dn)) {
+				kfree(dn);
+				brelse(bh);
+				goto destroy;
+			}
+		}
+		idx = ouichefs_dir_next_leaf(dindex, dblock, idx);
+		brelse(bh);
+	}
+
+	spin_lock(&ouichefs_dir_caches_lock);
+	if (!rcu_access_pointer(ci->dir_cache)) {
+		rcu_assign_pointer(ci->dir_cache, cache);
+		list_add_tail(&cache->lru, &ouichefs_dir_caches);
+		ouichefs_nr_dir_caches++;
+		cache = NULL;
+	}
+	spin_unlock(&ouichefs_dir_caches_lock);
+
+destroy:
+	if (cache)
+		ouichefs_dir_cache_destroy(cache);
+}
+
+/*
+ * Look for name in the cache of dir. Return -EAGAIN if dir has no cache.
+ */
+static int ouichefs_dir_cache_lookup(struct inode *dir,
+				     const struct qstr *name, uint32_t hash,
+				     uint32_t *ino)
+{
+	struct ouichefs_dir_cache *cache;
+	struct ouichefs_dir_name *dn;
+	int ret = -EAGAIN;
+
+	rcu_read_lock();
+	cache = rcu_dereference(OUICHEFS_INODE(dir)->dir_cache);
+	if (cache) {
+		dn = ouichefs_dir_cache_find(cache, hash, name);
+		ret = dn ? 0 : -ENOENT;
+		if (dn)
+			*ino = dn->ino;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Record in the cache of dir, if any, that name was added */
+static void ouichefs_dir_cache_add(struct inode *dir, const struct qstr *name,
+				   uint32_t hash, uint32_t ino, uint8_t type)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_cache *cache;
+	struct ouichefs_dir_name *dn;
+	int ret = -ENOMEM;
+
+	if (!rcu_access_pointer(ci->dir_cache))
+		return;
+	dn = ouichefs_dir_name_alloc(hash, name->name, name->len, ino, type);
+
+	rcu_read_lock();
+	cache = rcu_dereference(ci->dir_cache);
+	if (cache && dn)
+		ret = ouichefs_dir_cache_insert(cache, dn);
+	rcu_read_unlock();
+
+	/* A cache missing a name would make lookups fail */
+	if (ret) {
+		kfree(dn);
+		ouichefs_dir_cache_drop(ci);
+	}
+}
+
+/* Record in the cache of dir, if any, that name was removed */
+static void ouichefs_dir_cache_remove(struct inode *dir,
+				      const struct qstr *name, uint32_t hash)
+{
+	struct ouichefs_dir_cache *cache;
+	struct ouichefs_dir_name *dn;
+
+	rcu_read_lock();
+	cache = rcu_dereference(OUICHEFS_INODE(dir)->dir_cache);
+	if (cache) {
+		dn = ouichefs_dir_cache_find(cache, hash, name);
+		if (dn && !rhltable_remove(&cache->names, &dn->node,
+					   ouichefs_dir_cache_params)) {
+			cache->nr_names--;
+			kfree_rcu(dn, rcu);
+		}
+	}
+	rcu_read_unlock();
+}
+
+static unsigned long ouichefs_dir_cache_count(struct shrinker *shrink,
+					      struct shrink_control *sc)
+{
+	return READ_ONCE(ouichefs_nr_dir_caches);
+}
+
+static unsigned long ouichefs_dir_cache_scan(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	struct ouichefs_dir_cache *cache, *tmp;
+	unsigned long freed = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&ouichefs_dir_caches_lock);
+	while (freed < sc->nr_to_scan && !list_empty(&ouichefs_dir_caches)) {
+		cache = list_first_entry(&ouichefs_dir_caches,
+					 struct ouichefs_dir_cache, lru);
+		RCU_INIT_POINTER(cache->ci->dir_cache, NULL);
+		list_move_tail(&cache->lru, &dispose);
+		ouichefs_nr_dir_caches--;
+		freed++;
+	}
+	spin_unlock(&ouichefs_dir_caches_lock);
+	if (!freed)
+		return SHRINK_STOP;
+
+	/* One grace period for the whole batch */
+	synchronize_rcu();
+	list_for_each_entry_safe(cache, tmp, &dispose, lru)
+		ouichefs_dir_cache_destroy(cache);
+
+	return freed;
+}
+
+static struct shrinker ouichefs_dir_cache_shrinker = {
+	.count_objects = ouichefs_dir_cache_count,
+	.scan_objects = ouichefs_dir_cache_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+int ouichefs_init_dir_cache(void)
+{
+	return register_shrinker(&ouichefs_dir_cache_shrinker, "ouichefs-dir");
+}
+
+void ouichefs_destroy_dir_cache(void)
+{
+	unregister_shrinker(&ouichefs_dir_cache_shrinker);
+}
+
+/*
+ * Look for name in dir and store its inode number in ino. The first lookup
+ * caches the names of dir, which the next ones use instead of the leaves.
+ * Return 0 on success, -ENOENT if dir has no such file.
+ */
+int ouichefs_dir_lookup(struct inode *dir, const struct qstr *name,
+			uint32_t *ino)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_index *dindex;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh_index, *bh;
+	uint32_t hash = ouichefs_name_hash(name->name, name->len);
+	int i, ret;
+
+	ret = ouichefs_dir_cache_lookup(dir, name, hash, ino);
+	if (ret != -EAGAIN)
+		return ret;
+
+	bh_index = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh_index)
+		return -EIO;
+	dindex = (struct ouichefs_dir_index *)bh_index->b_data;
+
+	/* Cache the names of dir for the next lookups */
+	ouichefs_dir_cache_build(dir, dindex);
+
+	ret = -ENOENT;
+	if (!dindex->blocks[0])
+		goto end;
+
+	bh = ouichefs_dir_read_leaf(sb, dindex, ouichefs_dir_idx(dindex, hash));
+	if (!bh) {
+		ret = -EIO;
+		goto end;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	i = ouichefs_dir_find(dblock, name, hash);
+	if (i >= 0) {
+		*ino = ouichefs_dir_file(dblock, i)->inode;
+		ret = 0;
+	}
+	brelse(bh);
+
+end:
+	brelse(bh_index);
+	return ret;
+}
+
+/*
+ * Add inode to dir under the file name, recording its file type. Full leaves
+ * on the way are split, which takes new blocks from the partition.
+ * Return -EEXIST if the name is taken, -EMLINK if dir cannot grow anymore.
+ */
+int ouichefs_dir_add(struct inode *dir, const struct qstr *name,
+		     struct inode *inode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_index *dindex;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh_index, *bh = NULL;
+	uint32_t hash = ouichefs_name_hash(name->name, name->len), idx;
+	int need = sizeof(struct ouichefs_dir_entry) +
+		   OUICHEFS_FILE_SIZE(name->len);
+	void *buf = NULL;
+	int ret = 0;
+
+	bh_index = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh_index)
+		return -EIO;
+	dindex = (struct ouichefs_dir_index *)bh_index->b_data;
+
+	if (!dindex->blocks[0]) {
+		ret = ouichefs_dir_init(dir, dindex);
+		if (ret)
+			goto end;
+		ouichefs_journal_dirty(sb, bh_index);
+	}
+
+	for (;;) {
+		idx = ouichefs_dir_idx(dindex, hash);
+		bh = ouichefs_dir_read_leaf(sb, dindex, idx);
+		if (!bh) {
+			ret = -EIO;
+			goto end;
+		}
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		if (ouichefs_dir_find(dblock, name, hash) >= 0) {
+			ret = -EEXIST;
+			goto end;
+		}
+		if (ouichefs_dir_room(dblock) >= need)
+			break;
+
+		/* Making room needs a scratch copy of the leaf */
+		if (!buf) {
+			buf = kmalloc(OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+			if (!buf) {
+				ret = -ENOMEM;
+				goto end;
+			}
+		}
+
+		/* Reclaim the records of removed files if that is enough */
+		if (ouichefs_dir_room(dblock) + dblock->dead_size >= need) {
+			ouichefs_dir_rebuild(dblock, NULL, 0, buf);
+			break;
+		}
+
+		/* A leaf pointed to by a single entry needs a bigger table */
+		if (dblock->depth >= dindex->depth) {
+			ret = ouichefs_dir_grow(dir, dindex);
+			ouichefs_journal_dirty(sb, bh_index);
+			if (ret)
+				goto end;
+			idx = ouichefs_dir_idx(dindex, hash);
+		}
+		ret = ouichefs_dir_split(dir, dindex, bh, idx, buf);
+		if (ret)
+			goto end;
+		brelse(bh);
+		bh = NULL;
+	}
+
+	ouichefs_dir_insert(dblock, hash, name->name, name->len, inode->i_ino,
+			    fs_umode_to_ftype(inode->i_mode));
+	ouichefs_journal_dirty(sb, bh);
+
+	dindex->nr_files++;
+	ouichefs_journal_dirty(sb, bh_index);
+
+	ouichefs_dir_cache_add(dir, name, hash, inode->i_ino,
+			       fs_umode_to_ftype(inode->i_mode));
+
+end:
+	kfree(buf);
+	brelse(bh);
+	brelse(bh_index);
+	return ret;
+}
+
+/*
+ * Remove the file name from dir, leaving a tombstone in its leaf. No other file
+ * moves, so this is O(1) once the file is found.
+ * Return -ENOENT if dir has no such file.
+ */
+int ouichefs_dir_remove(struct inode *dir, const struct qstr *name)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_index *dindex;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh_index, *bh = NULL;
+	uint32_t hash = ouichefs_name_hash(name->name, name->len);
+	int i, ret = 0;
+
+	bh_index = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh_index)
+		return -EIO;
+	dindex = (struct ouichefs_dir_index *)bh_index->b_data;
+	if (!dindex->blocks[0]) {
+		ret = -ENOENT;
+		goto end;
+	}
+
+	bh = ouichefs_dir_read_leaf(sb, dindex, ouichefs_dir_idx(dindex, hash));
+	if (!bh) {
+		ret = -EIO;
+		goto end;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	i = ouichefs_dir_find(dblock, name, hash);
+	if (i < 0) {
+		ret = -ENOENT;
+		goto end;
+	}
+	dblock->entries[i].offset = 0;
+	dblock->dead_size += dblock->entries[i].size +
+			     sizeof(struct ouichefs_dir_entry);
+	dblock->nr_files--;
+	ouichefs_journal_dirty(sb, bh);
+
+	dindex->nr_files--;
+	ouichefs_journal_dirty(sb, bh_index);
+
+	ouichefs_dir_cache_remove(dir, name, hash);
+
+end:
+	brelse(bh);
+	brelse(bh_index);
+	return ret;
+}
+
+/*
+ * Return 1 if dir holds no file, 0 if it does.
+ */
+int ouichefs_dir_is_empty(struct inode *dir)
+{
+	struct buffer_head *bh;
+	int ret;
+
+	bh = sb_bread(dir->i_sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh)
+		return -EIO;
+	ret = !((struct ouichefs_dir_index *)bh->b_data)->nr_files;
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Free the pointer blocks and leaves of dir, which is being removed. Leaves
+ * are pointed to by consecutive entries of the table, so each is freed once.
+ */
+void ouichefs_dir_put_blocks(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_index *dindex;
+	struct buffer_head *bh_index, *bh;
+	uint32_t n, b, i, bno, prev = 0;
+	uint32_t *ptrs;
+
+	bh_index = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh_index)
+		return;
+	dindex = (struct ouichefs_dir_index *)bh_index->b_data;
+
+	n = 1U << dindex->depth;
+	for (b = 0; b < DIV_ROUND_UP(n, OUICHEFS_DIR_PTRS) && dindex->blocks[b];
+	     b++) {
+		bh = sb_bread(sb, dindex->blocks[b]);
+		if (bh) {
+			ptrs = (uint32_t *)bh->b_data;
+			for (i = 0; i < min_t(uint32_t,
+					      n - b * OUICHEFS_DIR_PTRS,
+					      OUICHEFS_DIR_PTRS); i++) {
+				bno = ptrs[i];
+				if (bno && bno != prev)
+					put_block(sbi, bno);
+				prev = bno;
+			}
+			brelse(bh);
+		}
+		put_block(sbi, dindex->blocks[b]);
+	}
+	brelse(bh_index);
+}
+
+/*
+ * Start reading the inode store blocks of the files of dblock, which callers of
+ * readdir such as ls -l are about to stat. The reads are plugged so that they
+ * reach the disk as one batch.
+ */
+static void ouichefs_dir_readahead(struct super_block *sb,
+				   struct ouichefs_dir_block *dblock)
+{
+	struct blk_plug plug;
+	uint32_t bno, prev = 0;
+	int i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < dblock->nr_entries; i++) {
+		if (ouichefs_dir_tomb(dblock, i))
+			continue;
+		bno = ouichefs_dir_file(dblock, i)->inode;
+		bno = bno / OUICHEFS_INODES_PER_BLOCK + 1;
+		if (bno != prev)
+			sb_breadahead(sb, bno);
+		prev = bno;
+	}
+	blk_finish_plug(&plug);
+}
 
 /*
  * Iterate over the files contained in dir and commit them in ctx.
- * This function is called by the VFS while ctx->pos changes.
+ * This function is called by the VFS while ctx->pos changes. Leaves are
+ * visited in table order and their files in hash order, that is by increasing
+ * ouichefs_dir_pos().
  * Return 0 on success.
  */
 static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(dir);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh_index, *bh;
+	struct ouichefs_dir_index *dindex;
+	struct ouichefs_dir_block *dblock;
+	struct ouichefs_file *f;
+	uint32_t idx, n, hash, prev;
+	unsigned int k;
+	loff_t pos;
 	int i;
 
 	/* Check that dir is a directory */
 	if (!S_ISDIR(inode->i_mode))
 		return -ENOTDIR;
 
-	/*
-	 * Check that ctx->pos is not bigger than what we can handle (including
-	 * . and ..)
-	 */
-	if (ctx->pos > OUICHEFS_MAX_SUBFILES + 2)
+	/* Check that ctx->pos is not past the last file */
+	if (ctx->pos >= OUICHEFS_DIR_END)
 		return 0;
 
 	/* Commit . and .. to ctx */
@@ -44,28 +1071,67 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 		return 0;
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci->index_block);
-	if (!bh)
+	bh_index = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index)
 		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	dindex = (struct ouichefs_dir_index *)bh_index->b_data;
+	if (!dindex->blocks[0])
+		goto end;
 
-	/* Iterate over the index block and commit subfiles */
-	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!dir_emit(ctx, f->filename, OUICHEFS_FILENAME_LEN, f->inode,
-			      DT_UNKNOWN))
-			break;
-		ctx->pos++;
+	/* Start from the leaf of the hash of ctx->pos */
+	n = 1U << dindex->depth;
+	idx = ouichefs_dir_idx(dindex, (ctx->pos - 2) >> 8);
+	while (idx < n) {
+		bh = ouichefs_dir_read_leaf(sb, dindex, idx);
+		if (!bh) {
+			brelse(bh_index);
+			return -EIO;
+		}
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		if (sbi->dir_readahead)
+			ouichefs_dir_readahead(sb, dblock);
+
+		/* Commit the files of the leaf from ctx->pos on */
+		for (i = 0, k = 0, prev = 0; i < dblock->nr_entries; i++) {
+			hash = dblock->entries[i].hash;
+			k = (i && hash == prev) ? k + 1 : 0;
+			prev = hash;
+			pos = ouichefs_dir_pos(hash, k);
+			if (pos < ctx->pos || ouichefs_dir_tomb(dblock, i))
+				continue;
+			f = ouichefs_dir_file(dblock, i);
+			ctx->pos = pos;
+			if (!dir_emit(ctx, f->filename, f->name_len, f->inode,
+				      fs_ftype_to_dtype(f->file_type))) {
+				brelse(bh);
+				brelse(bh_index);
+				return 0;
+			}
+			ctx->pos = pos + 1;
+		}
+
+		/* And skip the other entries of the table pointing to it */
+		idx = ouichefs_dir_next_leaf(dindex, dblock, idx);
+		brelse(bh);
 	}
 
-	brelse(bh);
+end:
+	ctx->pos = OUICHEFS_DIR_END;
+	brelse(bh_index);
 
 	return 0;
 }
 
+/* Positions are name hashes, see ouichefs_dir_pos() */
+static loff_t ouichefs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+	return generic_file_llseek_size(file, offset, whence, OUICHEFS_DIR_END,
+					OUICHEFS_DIR_END);
+}
+
 const struct file_operations ouichefs_dir_ops = {
 	.owner = THIS_MODULE,
+	.llseek = ouichefs_dir_llseek,
 	.iterate_shared = ouichefs_iterate,
+	.fsync = ouichefs_fsync,
 };
@@ -11,15 +11,50 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
 #include <linux/mpage.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/falloc.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
 
+/*
+ * Copy the content of block from into the newly allocated block to on disk.
+ * The copy is synced, since the page cache reads it without going through the
+ * buffer cache.
+ */
+static int ouichefs_copy_block(struct super_block *sb, uint32_t from,
+			       uint32_t to)
+{
+	struct buffer_head *bh_from, *bh_to;
+
+	bh_from = sb_bread(sb, from);
+	if (!bh_from)
+		return -EIO;
+	bh_to = ouichefs_new_block(sb, to);
+	if (!bh_to) {
+		brelse(bh_from);
+		return -ENOMEM;
+	}
+	memcpy(bh_to->b_data, bh_from->b_data, OUICHEFS_BLOCK_SIZE);
+	mark_buffer_dirty(bh_to);
+	sync_dirty_buffer(bh_to);
+	brelse(bh_to);
+	brelse(bh_from);
+
+	return 0;
+}
+
 /*
  * Map the buffer_head passed in argument with the iblock-th block of the file
  * represented by inode. If the requested block is not allocated and create is
- * true, allocate a new block on disk and map it.
+ * true, allocate a new block on disk and map it. If it is shared with a clone
+ * and create is true, map a private copy of it instead. Callers setting create
+ * hold a journal handle.
  */
 static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 				   struct buffer_head *bh_result, int create)
@@ -30,11 +65,21 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	struct ouichefs_file_index_block *index;
 	struct buffer_head *bh_index;
 	int ret = 0, bno;
+	bool cow = false;
 
 	/* If block number exceeds filesize, fail */
 	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
 		return -EFBIG;
 
+	/* A file without index block is a hole */
+	if (!ci->index_block) {
+		if (!create)
+			return 0;
+		ret = ouichefs_alloc_index(inode);
+		if (ret)
+			return ret;
+	}
+
 	/* Read index block from disk */
 	bh_index = sb_bread(sb, ci->index_block);
 	if (!bh_index)
@@ -50,18 +95,47 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 			ret = 0;
 			goto brelse_index;
 		}
-		bno = get_free_block(sbi);
+		bno = get_free_block(sbi, ci->index_block + 1 + iblock);
+		if (!bno) {
+			ret = -ENOSPC;
+			goto brelse_index;
+		}
+		index->blocks[iblock] = bno;
+		ouichefs_journal_dirty(sb, bh_index);
+		ouichefs_journal_add_inode(inode);
+		inode->i_blocks++;
+		mark_inode_dirty(inode);
+		/* a block filling a hole is zeroed instead of read */
+		set_buffer_new(bh_result);
+	} else if (create && is_block_shared(sbi, index->blocks[iblock])) {
+		/* copy-on-write: the file gets a private copy of the block */
+		bno = get_free_block(sbi, ci->index_block + 1 + iblock);
 		if (!bno) {
 			ret = -ENOSPC;
 			goto brelse_index;
 		}
+		/* an up-to-date buffer is written to the copy as it is */
+		cow = buffer_uptodate(bh_result);
+		if (!cow) {
+			ret = ouichefs_copy_block(sb, index->blocks[iblock],
+						  bno);
+			if (ret) {
+				put_unused_block(sbi, bno);
+				goto brelse_index;
+			}
+		}
+		put_block(sbi, index->blocks[iblock]);
 		index->blocks[iblock] = bno;
+		ouichefs_journal_dirty(sb, bh_index);
+		ouichefs_journal_add_inode(inode);
 	} else {
 		bno = index->blocks[iblock];
 	}
 
 	/* Map the physical block to the given buffer_head */
 	map_bh(bh_result, sb, bno);
+	if (cow)
+		mark_buffer_dirty(bh_result);
 
 brelse_index:
 	brelse(bh_index);
@@ -69,22 +143,122 @@ brelse_index:
 	return ret;
 }
 
+/*
+ * Remap the buffers of the locked page of inode that still map blocks shared
+ * with a clone to private copies, before the page is written to.
+ */
+static int ouichefs_unshare_page(struct inode *inode, struct page *page)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct buffer_head *head, *bh;
+	sector_t iblock;
+	int ret;
+
+	if (!sbi->bref_map || !page_has_buffers(page))
+		return 0;
+
+	iblock = (sector_t)page->index << (PAGE_SHIFT - inode->i_blkbits);
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_mapped(bh) && is_block_shared(sbi, bh->b_blocknr)) {
+			ret = ouichefs_file_get_block(inode, iblock, bh, 1);
+			if (ret)
+				return ret;
+		}
+		iblock++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	return 0;
+}
+
 /*
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
  */
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	return mpage_read_folio(folio, ouichefs_file_get_block);
+}
+
 static void ouichefs_readahead(struct readahead_control *rac)
 {
 	mpage_readahead(rac, ouichefs_file_get_block);
 }
 
 /*
- * Called by the page cache to write a dirty page to the physical disk (when
- * sync is called or when memory is needed).
+ * Turn the dirty page of inode into a hole if it only holds zeros: the block
+ * mapped by its buffer is freed and the buffer unmapped, so that there is
+ * nothing left to write. The page stays in the page cache, uptodate.
  */
-static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
+static void ouichefs_zero_page_to_hole(struct inode *inode, struct page *page)
 {
-	return block_write_full_page(page, ouichefs_file_get_block, wbc);
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh, *bh_index;
+	loff_t pos = page_offset(page), size = i_size_read(inode);
+	bool zero;
+	char *kaddr;
+
+	if (!page_has_buffers(page) || pos >= size)
+		return;
+	bh = page_buffers(page);
+	if (!buffer_mapped(bh) || !buffer_dirty(bh))
+		return;
+
+	/* bytes past the end of file are zeroed on write anyway */
+	kaddr = kmap_local_page(page);
+	zero = ouichefs_is_zero(kaddr, min_t(loff_t, PAGE_SIZE, size - pos));
+	kunmap_local(kaddr);
+	if (!zero)
+		return;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index)
+		return;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	if (index->blocks[page->index] == bh->b_blocknr) {
+		index->blocks[page->index] = 0;
+		put_block(OUICHEFS_SB(sb), bh->b_blocknr);
+		inode->i_blocks--;
+		ouichefs_journal_dirty(sb, bh_index);
+		mark_inode_dirty(inode);
+		clear_buffer_dirty(bh);
+		clear_buffer_mapped(bh);
+	}
+	brelse(bh_index);
+}
+
+/* Write a dirty page to disk, for ouichefs_writepages() */
+static int ouichefs_write_folio(struct folio *folio,
+				struct writeback_control *wbc, void *data)
+{
+	ouichefs_zero_page_to_hole(folio->mapping->host, &folio->page);
+
+	return block_write_full_page(&folio->page, ouichefs_file_get_block,
+				     wbc);
+}
+
+/*
+ * Called by the page cache to write the dirty pages of a file to the physical
+ * disk (when sync is called or when memory is needed). Pages of zeros become
+ * holes. Writing a page may allocate or free its block, so the pages are locked
+ * in a journal handle: there is no writepage, which gets them locked already.
+ */
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	struct super_block *sb = mapping->host->i_sb;
+	struct ouichefs_handle handle;
+	int ret;
+
+	ouichefs_journal_start(sb, &handle);
+	ret = write_cache_pages(mapping, wbc, ouichefs_write_folio, NULL);
+	ouichefs_journal_stop(sb, &handle);
+
+	return ret;
 }
 
 /*
@@ -97,135 +271,850 @@ static int ouichefs_write_begin(struct file *file,
 				unsigned int len, struct page **pagep,
 				void **fsdata)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
-	int err;
+	struct inode *inode = mapping->host;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_handle handle;
+	int err, retries = 0;
 	uint32_t nr_allocs = 0;
+	long nr_data;
 
 	/* Check if the write can be completed (enough space?) */
 	if (pos + len > OUICHEFS_MAX_FILESIZE)
 		return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
+retry:
+	/* i_blocks counts the index block, which an empty file has not */
+	nr_data = max_t(long, (long)inode->i_blocks - 1, 0);
+	nr_allocs = max(pos + len, inode->i_size) / OUICHEFS_BLOCK_SIZE;
+	if (nr_allocs > nr_data)
+		nr_allocs -= nr_data;
 	else
 		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
-		return -ENOSPC;
+	if (!OUICHEFS_INODE(inode)->index_block)
+		nr_allocs++;
+	if (nr_allocs > sbi->nr_free_blocks) {
+		err = -ENOSPC;
+		goto out;
+	}
 
 	/* prepare the write */
+	ouichefs_journal_start(inode->i_sb, &handle);
 	err = block_write_begin(mapping, pos, len, pagep,
 				ouichefs_file_get_block);
 	/* if this failed, reclaim newly allocated blocks */
 	if (err < 0) {
 		pr_err("%s:%d: newly allocated blocks reclaim not implemented yet\n",
 		       __func__, __LINE__);
+		goto stop;
 	}
+
+	/* buffers of a cached page may still map blocks shared by a clone */
+	err = ouichefs_unshare_page(inode, *pagep);
+	if (err) {
+		unlock_page(*pagep);
+		put_page(*pagep);
+	}
+stop:
+	ouichefs_journal_stop(inode->i_sb, &handle);
+out:
+	if (ouichefs_journal_retry(inode->i_sb, err, &retries))
+		goto retry;
 	return err;
 }
 
 /*
  * Called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * cache. This functions updates inode metadata.
  */
 static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 			      loff_t pos, unsigned int len, unsigned int copied,
 			      struct page *page, void *fsdata)
 {
 	int ret;
-	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
 
 	/* Complete the write() */
 	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
 	if (ret < len) {
 		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
 		       __func__, __LINE__);
-	} else {
-		uint32_t nr_blocks_old = inode->i_blocks;
-
-		/* Update inode metadata */
-		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
-		inode->i_mtime = inode->i_ctime = current_time(inode);
-		mark_inode_dirty(inode);
-
-		/* If file is smaller than before, free unused blocks */
-		if (nr_blocks_old > inode->i_blocks) {
-			int i;
-			struct buffer_head *bh_index;
-			struct ouichefs_file_index_block *index;
-
-			/* Free unused blocks from page cache */
-			truncate_pagecache(inode, inode->i_size);
-
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
-				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-				       file->f_path.dentry->d_name.name,
-				       nr_blocks_old - inode->i_blocks);
-				goto end;
-			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
-
-			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
-			     i++) {
-				put_block(OUICHEFS_SB(sb), index->blocks[i]);
-				index->blocks[i] = 0;
-			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
-		}
 	}
-end:
+	/*
+	 * i_size is kept by generic_write_end() and i_blocks by get_block.
+	 * Timestamps were updated before the write, by file_update_time(),
+	 * only in memory under lazytime.
+	 */
 	return ret;
 }
 
 const struct address_space_operations ouichefs_aops = {
+	.dirty_folio = block_dirty_folio,
+	.invalidate_folio = block_invalidate_folio,
+	.read_folio = ouichefs_read_folio,
 	.readahead = ouichefs_readahead,
-	.writepage = ouichefs_writepage,
+	.writepages = ouichefs_writepages,
 	.write_begin = ouichefs_write_begin,
-	.write_end = ouichefs_write_end
+	.write_end = ouichefs_write_end,
+	.migrate_folio = buffer_migrate_folio,
 };
 
-static int ouichefs_open(struct inode *inode, struct file *file) {
-	bool wronly = (file->f_flags & O_WRONLY) != 0;
-	bool rdwr = (file->f_flags & O_RDWR) != 0;
-	bool trunc = (file->f_flags & O_TRUNC) != 0;
-
-	if ((wronly || rdwr) && trunc && (inode->i_size != 0)) {
-		struct super_block *sb = inode->i_sb;
-		struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-		struct ouichefs_file_index_block *index;
-		struct buffer_head *bh_index;
-		sector_t iblock;
-
-		/* Read index block from disk */
-		bh_index = sb_bread(sb, ci->index_block);
-		if (!bh_index)
-			return -EIO;
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
-		for (iblock = 0; index->blocks[iblock] != 0; iblock++) {
-			put_block(sbi, index->blocks[iblock]);
-			index->blocks[iblock] = 0;
+/*
+ * Called when a page of a shared mapping is about to be written to. Like
+ * write_begin, it gives the page private copies of the blocks shared with a
+ * clone.
+ */
+static vm_fault_t ouichefs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct ouichefs_handle handle;
+	int err, retries = 0;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+retry:
+	ouichefs_journal_start(inode->i_sb, &handle);
+	err = block_page_mkwrite(vmf->vma, vmf, ouichefs_file_get_block);
+	if (!err) {
+		err = ouichefs_unshare_page(inode, vmf->page);
+		if (err)
+			unlock_page(vmf->page);
+	}
+	ouichefs_journal_stop(inode->i_sb, &handle);
+	if (ouichefs_journal_retry(inode->i_sb, err, &retries))
+		goto retry;
+	sb_end_pagefault(inode->i_sb);
+
+	return block_page_mkwrite_return(err);
+}
+
+static const struct vm_operations_struct ouichefs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ouichefs_page_mkwrite,
+};
+
+static int ouichefs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ouichefs_file_vm_ops;
+
+	return 0;
+}
+
+/*
+ * Return the bits holding the block number in an index entry of inode. Only
+ * the page-cache engine does not store a size in the upper bits.
+ */
+uint32_t ouichefs_entry_mask(struct inode *inode)
+{
+	if (ouichefs_file_engine(inode) == OUICHEFS_ENGINE_PAGECACHE)
+		return ~0U;
+
+	return BLOCK_NUMBER_MASK;
+}
+
+/*
+ * Zero the bytes [from, to) of block bno on disk.
+ */
+int ouichefs_zero_block(struct super_block *sb, uint32_t bno, size_t from,
+			size_t to)
+{
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	memset(bh->b_data + from, 0, to - from);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Return the buffer of block bno, which was just allocated, zeroed and dirty.
+ * Its old content is not read from disk, since none of it is kept.
+ * Return NULL if no buffer could be allocated.
+ */
+struct buffer_head *ouichefs_new_block(struct super_block *sb, uint32_t bno)
+{
+	struct buffer_head *bh;
+
+	bh = sb_getblk(sb, bno);
+	if (!bh)
+		return NULL;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+
+	return bh;
+}
+
+/*
+ * Give inode its index block if it does not have one yet. Regular files are
+ * created without one, which is only allocated when they get their first block,
+ * so that empty files cost no block. The index is taken at the start of a run
+ * of free blocks, the index_reserve ones after it being left to the first data
+ * blocks of the file. Page faults may race to give the file its index without
+ * the inode lock: the first one sets it, the others free the block they got.
+ */
+int ouichefs_alloc_index(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	if (ci->index_block)
+		return 0;
+
+	bno = find_free_run(sbi, READ_ONCE(sbi->index_goal),
+			    1 + sbi->index_reserve);
+	bno = get_free_block(sbi, bno);
+	if (!bno)
+		return -ENOSPC;
+	bh = ouichefs_new_block(sb, bno);
+	if (!bh) {
+		put_unused_block(sbi, bno);
+		return -ENOMEM;
+	}
+	if (cmpxchg(&ci->index_block, 0, bno)) {
+		bforget(bh);
+		put_unused_block(sbi, bno);
+		return 0;
+	}
+	ouichefs_journal_dirty(sb, bh);
+	brelse(bh);
+
+	spin_lock(&sbi->bitmap_lock);
+	sbi->index_goal = bno + 1 + sbi->index_reserve;
+	spin_unlock(&sbi->bitmap_lock);
+	inode->i_blocks++;
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * Zero len bytes at pos of a page-cache file through its page cache, so that
+ * the cached page and the block under it stay coherent.
+ */
+static int ouichefs_zero_pagecache(struct inode *inode, loff_t pos,
+				   unsigned int len)
+{
+	struct page *page;
+	void *fsdata = NULL;
+	int ret;
+
+	ret = ouichefs_write_begin(NULL, inode->i_mapping, pos, len, &page,
+				   &fsdata);
+	if (ret)
+		return ret;
+	zero_user(page, offset_in_page(pos), len);
+	ret = ouichefs_write_end(NULL, inode->i_mapping, pos, len, len, page,
+				 fsdata);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Resize a file of the page-cache or direct engine to size. Blocks past the new
+ * end of file are freed, the tail of the new last block is zeroed so that it
+ * reads back as zeros if the file grows again. Growing leaves a hole.
+ */
+static int ouichefs_fixed_truncate(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	uint32_t mask = ouichefs_entry_mask(inode), bno, first, last;
+	size_t off = size % OUICHEFS_BLOCK_SIZE;
+	loff_t old_size = inode->i_size;
+	int ret = 0;
+
+	/* nothing to free in a file without index block */
+	if (size >= old_size || !ci->index_block) {
+		truncate_setsize(inode, size);
+		return 0;
+	}
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	bno = index->blocks[size / OUICHEFS_BLOCK_SIZE] & mask;
+	if (off && bno) {
+		if (ouichefs_file_engine(inode) == OUICHEFS_ENGINE_PAGECACHE)
+			ret = ouichefs_zero_pagecache(
+				inode, size,
+				min_t(loff_t, old_size,
+				      size - off + OUICHEFS_BLOCK_SIZE) -
+					size);
+		else
+			ret = ouichefs_zero_block(sb, bno, off,
+						  OUICHEFS_BLOCK_SIZE);
+		if (ret)
+			goto brelse_index;
+	}
+
+	truncate_setsize(inode, size);
+
+	first = DIV_ROUND_UP(size, OUICHEFS_BLOCK_SIZE);
+	last = min_t(uint32_t, OUICHEFS_BLOCK_SIZE >> 2,
+		     DIV_ROUND_UP(old_size, OUICHEFS_BLOCK_SIZE));
+	if (first < last) {
+		inode->i_blocks -= put_index_blocks(OUICHEFS_SB(sb),
+						    &index->blocks[first],
+						    last - first, mask);
+		ouichefs_journal_dirty(sb, bh_index);
+	}
+
+brelse_index:
+	brelse(bh_index);
+
+	return ret;
+}
+
+/*
+ * Punch a hole in [start, end) of a file of the page-cache or direct engine.
+ * The blocks fully inside the range are freed, the partial blocks at its edges
+ * are zeroed.
+ */
+static int ouichefs_fixed_punch(struct inode *inode, loff_t start, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	uint32_t mask = ouichefs_entry_mask(inode), bno, first, last;
+	sector_t edges[2], iblock;
+	loff_t bstart, from, to;
+	int i, ret = 0;
+
+	/* a file without index block is a hole already */
+	if (!OUICHEFS_INODE(inode)->index_block)
+		return 0;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	/* zero the partially covered blocks at both edges of the range */
+	edges[0] = start / OUICHEFS_BLOCK_SIZE;
+	edges[1] = (end - 1) / OUICHEFS_BLOCK_SIZE;
+	for (i = 0; i < 2; i++) {
+		iblock = edges[i];
+		if (i == 1 && iblock == edges[0])
+			break;
+		bstart = (loff_t)iblock * OUICHEFS_BLOCK_SIZE;
+		from = max_t(loff_t, start, bstart);
+		to = min_t(loff_t, end, bstart + OUICHEFS_BLOCK_SIZE);
+		bno = index->blocks[iblock] & mask;
+		if (!bno || to - from == OUICHEFS_BLOCK_SIZE)
+			continue;
+
+		if (ouichefs_file_engine(inode) == OUICHEFS_ENGINE_PAGECACHE)
+			ret = ouichefs_zero_pagecache(inode, from, to - from);
+		else
+			ret = ouichefs_zero_block(sb, bno, from - bstart,
+						  to - bstart);
+		if (ret)
+			goto brelse_index;
+	}
+
+	/* free the blocks fully inside the range */
+	first = DIV_ROUND_UP(start, OUICHEFS_BLOCK_SIZE);
+	last = end / OUICHEFS_BLOCK_SIZE;
+	if (first < last) {
+		inode->i_blocks -= put_index_blocks(OUICHEFS_SB(sb),
+						    &index->blocks[first],
+						    last - first, mask);
+		ouichefs_journal_dirty(sb, bh_index);
+	}
+
+brelse_index:
+	brelse(bh_index);
+
+	return ret;
+}
+
+/*
+ * Resize inode to size, freeing the blocks past the new end of file.
+ */
+int ouichefs_truncate(struct inode *inode, loff_t size)
+{
+	if (ouichefs_file_engine(inode) == OUICHEFS_ENGINE_VARBLOCK)
+		return ouichefs_varblock_truncate(inode, size);
+	if (ouichefs_file_compress(inode))
+		return ouichefs_compr_truncate(inode, size);
+
+	return ouichefs_fixed_truncate(inode, size);
+}
+
+/*
+ * fallocate of every I/O engine. Only FALLOC_FL_PUNCH_HOLE and
+ * FALLOC_FL_ZERO_RANGE are supported. Both turn the blocks fully inside the
+ * range into holes and zero the partial blocks at its edges, without touching
+ * the rest of the file nor of its page cache. ZERO_RANGE may also grow the
+ * file, with a hole.
+ */
+long ouichefs_fallocate(struct file *file, int mode, loff_t offset,
+			loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	loff_t end = offset + len, size;
+	struct ouichefs_handle handle;
+	long ret = 0;
+
+	if (!(mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) ||
+	    (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		      FALLOC_FL_ZERO_RANGE)))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	ouichefs_journal_start(inode->i_sb, &handle);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto unlock;
+	}
+
+	/* only the bytes before the end of file have to be zeroed */
+	size = min_t(loff_t, end, inode->i_size);
+	if (offset < size) {
+		ret = filemap_write_and_wait_range(inode->i_mapping, offset,
+						   size - 1);
+		if (ret)
+			goto unlock;
+		truncate_pagecache_range(inode, offset, size - 1);
+
+		if (ouichefs_file_engine(inode) == OUICHEFS_ENGINE_VARBLOCK)
+			ret = ouichefs_varblock_punch(inode, offset, size);
+		else
+			ret = ouichefs_fixed_punch(inode, offset, size);
+		if (ret)
+			goto unlock;
+	}
+
+	if ((mode & FALLOC_FL_ZERO_RANGE) && !(mode & FALLOC_FL_KEEP_SIZE) &&
+	    end > inode->i_size) {
+		ret = ouichefs_truncate(inode, end);
+		if (ret)
+			goto unlock;
+	}
+
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+unlock:
+	ouichefs_journal_stop(inode->i_sb, &handle);
+	inode_unlock(inode);
+
+	return ret;
+}
+
+/*
+ * remap_file_range of the page-cache engine, behind FICLONE, FICLONERANGE and
+ * copy_file_range(). The destination range is made to reference the blocks of
+ * the source range, which become shared: only the index block of the
+ * destination is written. Deduplication is not supported.
+ */
+loff_t ouichefs_remap_file_range(struct file *file_in, loff_t pos_in,
+				 struct file *file_out, loff_t pos_out,
+				 loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+	struct super_block *sb = dst->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_file_index_block *index_in, *index_out;
+	struct buffer_head *bh_in, *bh_out;
+	uint32_t i, nr, first_in, first_out, bno, run = 0, run_len = 0;
+	struct ouichefs_handle handle = { };
+	loff_t ret;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+		return -EINVAL;
+	if (remap_flags & REMAP_FILE_DEDUP)
+		return -EOPNOTSUPP;
+
+	/* sharing needs a refcount map and the fixed layout of the index */
+	if (!sbi->bref_map ||
+	    ouichefs_file_engine(src) != OUICHEFS_ENGINE_PAGECACHE ||
+	    ouichefs_file_engine(dst) != OUICHEFS_ENGINE_PAGECACHE ||
+	    ouichefs_file_compress(src) || ouichefs_file_compress(dst))
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret < 0 || len == 0)
+		goto unlock;
+
+	/* cached pages of the destination map the blocks it is losing */
+	truncate_inode_pages_range(&dst->i_data, pos_out,
+				   PAGE_ALIGN(pos_out + len) - 1);
+
+	ouichefs_journal_start(sb, &handle);
+	ret = ouichefs_alloc_index(dst);
+	if (ret)
+		goto unlock;
+
+	/* a source without index block is a hole */
+	bh_in = NULL;
+	index_in = NULL;
+	if (OUICHEFS_INODE(src)->index_block) {
+		bh_in = sb_bread(sb, OUICHEFS_INODE(src)->index_block);
+		if (!bh_in) {
+			ret = -EIO;
+			goto unlock;
+		}
+		index_in = (struct ouichefs_file_index_block *)bh_in->b_data;
+	}
+	bh_out = sb_bread(sb, OUICHEFS_INODE(dst)->index_block);
+	if (!bh_out) {
+		brelse(bh_in);
+		ret = -EIO;
+		goto unlock;
+	}
+	index_out = (struct ouichefs_file_index_block *)bh_out->b_data;
+
+	first_in = pos_in / OUICHEFS_BLOCK_SIZE;
+	first_out = pos_out / OUICHEFS_BLOCK_SIZE;
+	nr = DIV_ROUND_UP(len, OUICHEFS_BLOCK_SIZE);
+	for (i = 0; i < nr; i++) {
+		bno = index_in ? index_in->blocks[first_in + i] : 0;
+		if (bno && get_block_ref(sbi, bno))
+			break;
+		if (index_out->blocks[first_out + i]) {
+			put_block_run(sbi, &run, &run_len,
+				      index_out->blocks[first_out + i]);
+			dst->i_blocks--;
 		}
-		inode->i_size = 0;
-		inode->i_blocks = 0;
+		index_out->blocks[first_out + i] = bno;
+		if (bno)
+			dst->i_blocks++;
+	}
+	put_block_run(sbi, &run, &run_len, 0);
+	ouichefs_journal_dirty(sb, bh_out);
+	brelse(bh_out);
+	brelse(bh_in);
 
-		brelse(bh_index);
+	/* a block shared by too many files stops the clone short */
+	if (!i) {
+		ret = -EMLINK;
+		goto unlock;
 	}
-	
+	ret = min_t(loff_t, len, (loff_t)i * OUICHEFS_BLOCK_SIZE);
+	if (pos_out + ret > dst->i_size)
+		i_size_write(dst, pos_out + ret);
+	dst->i_mtime = dst->i_ctime = current_time(dst);
+	mark_inode_dirty(dst);
+
+unlock:
+	ouichefs_journal_stop(sb, &handle);
+	unlock_two_nondirectories(src, dst);
+
+	return ret;
+}
+
+/*
+ * Return the offset of the first data (SEEK_DATA) or hole (SEEK_HOLE) byte at
+ * or after offset in a file of the page-cache or direct engine. Only the index
+ * block is read.
+ */
+static loff_t ouichefs_fixed_seek_hole_data(struct inode *inode,
+					    loff_t offset, int whence)
+{
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	uint32_t mask = ouichefs_entry_mask(inode);
+	sector_t iblock;
+	loff_t pos;
+
+	if (offset < 0 || offset >= inode->i_size)
+		return -ENXIO;
+
+	/* a file without index block is a hole */
+	if (!OUICHEFS_INODE(inode)->index_block)
+		return whence == SEEK_DATA ? -ENXIO : offset;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(inode->i_sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	for (iblock = offset / OUICHEFS_BLOCK_SIZE;
+	     iblock < (OUICHEFS_BLOCK_SIZE >> 2) &&
+	     (loff_t)iblock * OUICHEFS_BLOCK_SIZE < inode->i_size;
+	     iblock++) {
+		if (!!(index->blocks[iblock] & mask) == (whence == SEEK_DATA))
+			break;
+	}
+	brelse(bh_index);
+
+	pos = max_t(loff_t, offset, (loff_t)iblock * OUICHEFS_BLOCK_SIZE);
+	if (pos >= inode->i_size)
+		return whence == SEEK_DATA ? -ENXIO : inode->i_size;
+
+	return pos;
+}
+
+/*
+ * llseek of every I/O engine. SEEK_DATA and SEEK_HOLE are answered from the
+ * index block, so that sparse files are copied without reading their holes.
+ */
+loff_t ouichefs_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+	loff_t pos;
+
+	switch (whence) {
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		if (ouichefs_file_engine(inode) == OUICHEFS_ENGINE_VARBLOCK)
+			pos = ouichefs_varblock_seek_hole_data(inode, offset,
+							       whence);
+		else
+			pos = ouichefs_fixed_seek_hole_data(inode, offset,
+							    whence);
+		inode_unlock_shared(inode);
+		if (pos < 0)
+			return pos;
+		return vfs_setpos(file, pos, inode->i_sb->s_maxbytes);
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+}
+
+/*
+ * Return the I/O engine owning the data of inode. Files that do not record an
+ * engine belong to the one selected at mount time.
+ */
+uint32_t ouichefs_file_engine(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	uint32_t engine =
+		OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_ENGINE_MASK;
+
+	if (engine == OUICHEFS_ENGINE_DEFAULT)
+		engine = sbi->engine;
+
+	return engine;
+}
+
+/*
+ * Plug the file operations of the I/O engine owning the regular file inode.
+ */
+void ouichefs_set_file_ops(struct inode *inode)
+{
+	switch (ouichefs_file_engine(inode)) {
+	case OUICHEFS_ENGINE_DIRECT:
+		inode->i_fop = &ouichefs_direct_file_ops;
+		break;
+	case OUICHEFS_ENGINE_VARBLOCK:
+		inode->i_fop = &ouichefs_varblock_file_ops;
+		inode->i_mapping->a_ops = &ouichefs_varblock_aops;
+		return;
+	default:
+		if (ouichefs_file_compress(inode)) {
+			inode->i_fop = &ouichefs_compr_file_ops;
+			inode->i_mapping->a_ops = &ouichefs_compr_aops;
+			return;
+		}
+		inode->i_fop = &ouichefs_file_ops;
+		break;
+	}
+	inode->i_mapping->a_ops = &ouichefs_aops;
+}
+
+/*
+ * Count the open files of inode, so that the engine of a file is only switched
+ * when no other open file uses its operations. An open racing with a switch
+ * may have been given the operations from before it: give it the new ones.
+ */
+int ouichefs_file_open(struct inode *inode, struct file *file)
+{
+	spin_lock(&inode->i_lock);
+	OUICHEFS_INODE(inode)->nr_opens++;
+	if (file->f_op != inode->i_fop)
+		replace_fops(file, fops_get(inode->i_fop));
+	spin_unlock(&inode->i_lock);
+
+	return 0;
+}
+
+int ouichefs_file_release(struct inode *inode, struct file *file)
+{
+	spin_lock(&inode->i_lock);
+	OUICHEFS_INODE(inode)->nr_opens--;
+	spin_unlock(&inode->i_lock);
+
+	return 0;
+}
+
+/*
+ * The ioctls switching the engine rewrite i_flags: they need a file open for
+ * writing by the owner of the inode, on a writable mount. Lock the inode.
+ */
+static int ouichefs_switch_lock(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	int ret;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!inode_owner_or_capable(file_mnt_idmap(file), inode))
+		return -EPERM;
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+	inode_lock(inode);
+
+	return 0;
+}
+
+static void ouichefs_switch_unlock(struct file *file)
+{
+	inode_unlock(file_inode(file));
+	mnt_drop_write_file(file);
+}
+
+/*
+ * Set the i_flags of the inode of file and switch its operations, and those of
+ * file, to the engine they select. Operations in use cannot be switched under
+ * their users: this is refused unless file is the only open file of the inode,
+ * the inode has no page cache and no mapping of file, whose vm_ops belong to
+ * the engine it was mapped with. Caller must hold the inode lock.
+ */
+static int ouichefs_switch_ops(struct file *file, uint32_t flags)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	spin_lock(&inode->i_lock);
+	if (ci->nr_opens != 1 || inode->i_mapping->nrpages ||
+	    mapping_mapped(inode->i_mapping)) {
+		spin_unlock(&inode->i_lock);
+		return -EBUSY;
+	}
+	ci->i_flags = flags;
+	ouichefs_set_file_ops(inode);
+	replace_fops(file, fops_get(inode->i_fop));
+	spin_unlock(&inode->i_lock);
+	mark_inode_dirty(inode);
+
 	return 0;
 }
 
+/*
+ * ioctls common to all I/O engines. SET_ENGINE and SET_COMPRESS only apply to
+ * empty files, since the engines do not share the layout of the index block,
+ * and only to files no other open file uses, see ouichefs_switch_ops(). Only
+ * page-cache files can be compressed.
+ */
+long ouichefs_engine_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t flags;
+	int engine, algo, ret;
+
+	switch (cmd) {
+	case GET_ENGINE:
+		return put_user(ouichefs_file_engine(inode), (int __user *)arg);
+	case SET_ENGINE:
+		if (get_user(engine, (int __user *)arg))
+			return -EFAULT;
+		if (engine < OUICHEFS_ENGINE_PAGECACHE ||
+		    engine > OUICHEFS_ENGINE_VARBLOCK)
+			return -EINVAL;
+
+		ret = ouichefs_switch_lock(file);
+		if (ret)
+			return ret;
+		if (inode->i_size != 0) {
+			ret = -EBUSY;
+		} else {
+			flags = (ci->i_flags & ~OUICHEFS_INODE_ENGINE_MASK) |
+				engine;
+			if (engine != OUICHEFS_ENGINE_PAGECACHE)
+				flags &= ~OUICHEFS_INODE_COMPR_MASK;
+			ret = ouichefs_switch_ops(file, flags);
+		}
+		ouichefs_switch_unlock(file);
+		return ret;
+	case GET_COMPRESS:
+		return put_user(ouichefs_file_compress(inode),
+				(int __user *)arg);
+	case SET_COMPRESS:
+		if (get_user(algo, (int __user *)arg))
+			return -EFAULT;
+		if (algo < OUICHEFS_COMPRESS_NONE ||
+		    algo > OUICHEFS_COMPRESS_ZSTD)
+			return -EINVAL;
+
+		ret = ouichefs_switch_lock(file);
+		if (ret)
+			return ret;
+		if (ouichefs_file_engine(inode) != OUICHEFS_ENGINE_PAGECACHE) {
+			ret = -EINVAL;
+		} else if (inode->i_size != 0) {
+			ret = -EBUSY;
+		} else {
+			/* record the engine, the mount default may change */
+			flags = (ci->i_flags & ~(OUICHEFS_INODE_ENGINE_MASK |
+						 OUICHEFS_INODE_COMPR_MASK)) |
+				OUICHEFS_ENGINE_PAGECACHE |
+				(algo << OUICHEFS_INODE_COMPR_SHIFT);
+			ret = ouichefs_switch_ops(file, flags);
+		}
+		ouichefs_switch_unlock(file);
+		return ret;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * fsync of every I/O engine and of directories. The data of the file is written
+ * first, then the running transaction is committed, which makes the metadata
+ * updates of all the files durable at once.
+ */
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	int ret;
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+	ret = ouichefs_journal_commit(sb);
+	if (ret)
+		return ret;
+
+	/* the data written with no metadata to commit */
+	return blkdev_issue_flush(sb->s_bdev);
+}
+
 const struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
-	.open = ouichefs_open,
-	.llseek = generic_file_llseek,
+	.open = ouichefs_file_open,
+	.release = ouichefs_file_release,
+	.llseek = ouichefs_llseek,
+	.fallocate = ouichefs_fallocate,
+	.remap_file_range = ouichefs_remap_file_range,
+	.mmap = ouichefs_file_mmap,
 	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter
+	.write_iter = generic_file_write_iter,
+	.splice_read = filemap_splice_read,
+	.splice_write = iter_file_splice_write,
+	.fsync = ouichefs_fsync,
+	.unlocked_ioctl = ouichefs_engine_ioctl
 };
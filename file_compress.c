@@ -0,0 +1,733 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/cpumask.h>
+#include <linux/crypto.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/writeback.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Compressed files are page-cache files whose data is stored by clusters of
+ * OUICHEFS_CLUSTER_BLOCKS blocks. The c-th cluster owns the entries
+ * [c * OUICHEFS_CLUSTER_BLOCKS, (c + 1) * OUICHEFS_CLUSTER_BLOCKS) of the index
+ * block. A cluster that does not compress well is stored as is, one block per
+ * entry. A compressed cluster has OUICHEFS_COMPR_ADDR in its first entry and
+ * the blocks of its compressed stream in the following ones. The stream starts
+ * with its length as a __le32.
+ */
+#define OUICHEFS_COMPR_HDR sizeof(__le32)
+#define OUICHEFS_COMPR_MAX \
+	((OUICHEFS_CLUSTER_BLOCKS - 1) * OUICHEFS_BLOCK_SIZE)
+
+static const char *const ouichefs_compr_names[] = {
+	[OUICHEFS_COMPRESS_LZ4] = "lz4",
+	[OUICHEFS_COMPRESS_ZSTD] = "zstd",
+};
+
+/*
+ * Return the compression algorithm of inode, OUICHEFS_COMPRESS_NONE for a file
+ * stored as is.
+ */
+uint32_t ouichefs_file_compress(struct inode *inode)
+{
+	return (OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_COMPR_MASK) >>
+	       OUICHEFS_INODE_COMPR_SHIFT;
+}
+
+/* A transform and the buffer of a compressed stream it works with */
+struct ouichefs_compr_ws {
+	struct list_head list; /* In the idle list of its pool */
+	struct crypto_comp *tfm;
+	char buf[OUICHEFS_COMPR_MAX];
+};
+
+void ouichefs_compr_init(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_compr_pool *pool;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sbi->compr_pools); i++) {
+		pool = &sbi->compr_pools[i];
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->idle);
+		pool->nr = 0;
+		init_waitqueue_head(&pool->wait);
+	}
+}
+
+/* Free the transforms of every pool, none of which is in use any more */
+void ouichefs_compr_cleanup(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_compr_ws *ws, *tmp;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sbi->compr_pools); i++) {
+		list_for_each_entry_safe(ws, tmp, &sbi->compr_pools[i].idle,
+					 list) {
+			crypto_free_comp(ws->tfm);
+			kvfree(ws);
+		}
+	}
+}
+
+/*
+ * Return an idle transform of algorithm algo, to be given back with
+ * ouichefs_compr_put(). Up to one transform per CPU is allocated on demand, so
+ * that clusters of different files are compressed in parallel, and callers
+ * wait for one to become idle past that.
+ */
+static struct ouichefs_compr_ws *
+ouichefs_compr_get(struct ouichefs_sb_info *sbi, uint32_t algo)
+{
+	struct ouichefs_compr_pool *pool;
+	struct ouichefs_compr_ws *ws;
+	struct crypto_comp *tfm;
+
+	if (algo < OUICHEFS_COMPRESS_LZ4 || algo > OUICHEFS_COMPRESS_ZSTD)
+		return ERR_PTR(-EINVAL);
+	pool = &sbi->compr_pools[algo];
+
+	spin_lock(&pool->lock);
+	while (list_empty(&pool->idle) && pool->nr >= num_online_cpus()) {
+		spin_unlock(&pool->lock);
+		wait_event(pool->wait, !list_empty_careful(&pool->idle) ||
+				       READ_ONCE(pool->nr) < num_online_cpus());
+		spin_lock(&pool->lock);
+	}
+	ws = list_first_entry_or_null(&pool->idle, struct ouichefs_compr_ws,
+				      list);
+	if (ws) {
+		list_del(&ws->list);
+		spin_unlock(&pool->lock);
+		return ws;
+	}
+	pool->nr++;
+	spin_unlock(&pool->lock);
+
+	ws = kvmalloc(sizeof(*ws), GFP_NOFS);
+	if (!ws) {
+		tfm = ERR_PTR(-ENOMEM);
+		goto unreserve;
+	}
+	tfm = crypto_alloc_comp(ouichefs_compr_names[algo], 0, 0);
+	if (IS_ERR(tfm)) {
+		pr_err("%s compression is not available\n",
+		       ouichefs_compr_names[algo]);
+		kvfree(ws);
+		goto unreserve;
+	}
+	ws->tfm = tfm;
+
+	return ws;
+
+unreserve:
+	spin_lock(&pool->lock);
+	pool->nr--;
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wait);
+
+	return ERR_CAST(tfm);
+}
+
+static void ouichefs_compr_put(struct ouichefs_sb_info *sbi, uint32_t algo,
+			       struct ouichefs_compr_ws *ws)
+{
+	struct ouichefs_compr_pool *pool = &sbi->compr_pools[algo];
+
+	spin_lock(&pool->lock);
+	list_add(&ws->list, &pool->idle);
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wait);
+}
+
+/*
+ * Mark the blocks of the cluster starting at entries as unused and clear its
+ * entries. Return the number of blocks freed.
+ */
+static uint32_t ouichefs_put_cluster(struct ouichefs_sb_info *sbi,
+				     uint32_t *entries)
+{
+	if (entries[0] == OUICHEFS_COMPR_ADDR) {
+		entries[0] = 0;
+		return put_index_blocks(sbi, &entries[1],
+					OUICHEFS_CLUSTER_BLOCKS - 1, ~0U);
+	}
+
+	return put_index_blocks(sbi, entries, OUICHEFS_CLUSTER_BLOCKS, ~0U);
+}
+
+/*
+ * Read the c-th cluster of inode from disk into buf, decompressing it if
+ * needed. Holes read as zeros.
+ */
+static int ouichefs_read_cluster(struct inode *inode, pgoff_t c, char *buf)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh;
+	struct ouichefs_compr_ws *ws;
+	uint32_t entries[OUICHEFS_CLUSTER_BLOCKS], clen;
+	uint32_t algo = ouichefs_file_compress(inode);
+	unsigned int dlen = OUICHEFS_CLUSTER_SIZE;
+	int i, ret = 0;
+
+	/* a file without index block is a hole */
+	if (!OUICHEFS_INODE(inode)->index_block) {
+		memset(buf, 0, OUICHEFS_CLUSTER_SIZE);
+		return 0;
+	}
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	memcpy(entries, &index->blocks[c * OUICHEFS_CLUSTER_BLOCKS],
+	       sizeof(entries));
+	brelse(bh_index);
+
+	/* a cluster stored as is */
+	if (entries[0] != OUICHEFS_COMPR_ADDR) {
+		for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++) {
+			if (!entries[i]) {
+				memset(buf + i * OUICHEFS_BLOCK_SIZE, 0,
+				       OUICHEFS_BLOCK_SIZE);
+				continue;
+			}
+			bh = sb_bread(sb, entries[i]);
+			if (!bh)
+				return -EIO;
+			memcpy(buf + i * OUICHEFS_BLOCK_SIZE, bh->b_data,
+			       OUICHEFS_BLOCK_SIZE);
+			brelse(bh);
+		}
+		return 0;
+	}
+
+	ws = ouichefs_compr_get(sbi, algo);
+	if (IS_ERR(ws))
+		return PTR_ERR(ws);
+
+	for (i = 1; i < OUICHEFS_CLUSTER_BLOCKS && entries[i]; i++) {
+		bh = sb_bread(sb, entries[i]);
+		if (!bh) {
+			ret = -EIO;
+			goto put_ws;
+		}
+		memcpy(ws->buf + (i - 1) * OUICHEFS_BLOCK_SIZE, bh->b_data,
+		       OUICHEFS_BLOCK_SIZE);
+		brelse(bh);
+	}
+
+	clen = le32_to_cpu(*(__le32 *)ws->buf);
+	if (clen > (i - 1) * OUICHEFS_BLOCK_SIZE - OUICHEFS_COMPR_HDR) {
+		pr_err("corrupted cluster %lu of inode %lu\n", c, inode->i_ino);
+		ret = -EIO;
+		goto put_ws;
+	}
+
+	ret = crypto_comp_decompress(ws->tfm, ws->buf + OUICHEFS_COMPR_HDR,
+				     clen, buf, &dlen);
+	if (ret) {
+		pr_err("failed to decompress cluster %lu of inode %lu\n", c,
+		       inode->i_ino);
+		ret = -EIO;
+		goto put_ws;
+	}
+	memset(buf + dlen, 0, OUICHEFS_CLUSTER_SIZE - dlen);
+
+put_ws:
+	ouichefs_compr_put(sbi, algo, ws);
+
+	return ret;
+}
+
+/*
+ * Allocate blocks holding the nr blocks of data, and record them in entries.
+ * If holes is set, blocks of zeros are recorded as holes instead. Nothing is
+ * allocated on failure.
+ */
+static int ouichefs_write_blocks(struct inode *inode, uint32_t *entries,
+				 const char *data, int nr, bool holes)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	int i, nr_allocs = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (holes && ouichefs_is_zero(data + i * OUICHEFS_BLOCK_SIZE,
+					      OUICHEFS_BLOCK_SIZE)) {
+			entries[i] = 0;
+			continue;
+		}
+		entries[i] = get_free_block(sbi,
+					    OUICHEFS_INODE(inode)->index_block);
+		if (!entries[i])
+			goto put_blocks;
+		bh = ouichefs_new_block(sb, entries[i]);
+		if (!bh) {
+			put_block(sbi, entries[i]);
+			goto put_blocks;
+		}
+		memcpy(bh->b_data, data + i * OUICHEFS_BLOCK_SIZE,
+		       OUICHEFS_BLOCK_SIZE);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		nr_allocs++;
+	}
+	inode->i_blocks += nr_allocs;
+
+	return 0;
+
+put_blocks:
+	put_index_blocks(sbi, entries, i, ~0U);
+
+	return -ENOSPC;
+}
+
+/*
+ * Store the c-th cluster of inode, whose data is in buf, in new blocks and free
+ * the old ones. The bytes of buf past the end of file are zeroed first. The
+ * cluster is compressed if that saves at least one block.
+ */
+static int ouichefs_store_cluster(struct inode *inode, pgoff_t c, char *buf)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	struct ouichefs_compr_ws *ws = NULL;
+	uint32_t entries[OUICHEFS_CLUSTER_BLOCKS] = { 0 }, *old;
+	uint32_t algo = ouichefs_file_compress(inode);
+	loff_t start = (loff_t)c * OUICHEFS_CLUSTER_SIZE;
+	size_t len = 0;
+	unsigned int clen = OUICHEFS_COMPR_MAX - OUICHEFS_COMPR_HDR;
+	int nr = 0, nr_compr;
+	int ret;
+
+	if (start < inode->i_size)
+		len = min_t(loff_t, inode->i_size - start,
+			    OUICHEFS_CLUSTER_SIZE);
+	memset(buf + len, 0, OUICHEFS_CLUSTER_SIZE - len);
+	nr = DIV_ROUND_UP(len, OUICHEFS_BLOCK_SIZE);
+
+	/* a cluster of zeros is a hole, it takes no block */
+	if (ouichefs_is_zero(buf, len))
+		nr = 0;
+
+	/* a file without index block is a hole already */
+	if (!nr && !OUICHEFS_INODE(inode)->index_block)
+		return 0;
+	ret = ouichefs_alloc_index(inode);
+	if (ret)
+		return ret;
+
+	/* a cluster that cannot be compressed is stored as is */
+	ret = -EINVAL;
+	if (nr > 1) {
+		ws = ouichefs_compr_get(sbi, algo);
+		if (IS_ERR(ws))
+			ws = NULL;
+		else
+			ret = crypto_comp_compress(ws->tfm, buf, len,
+						   ws->buf + OUICHEFS_COMPR_HDR,
+						   &clen);
+	}
+
+	nr_compr = DIV_ROUND_UP(clen + OUICHEFS_COMPR_HDR, OUICHEFS_BLOCK_SIZE);
+	if (!ret && nr_compr < nr) {
+		*(__le32 *)ws->buf = cpu_to_le32(clen);
+		/* the buffer is reused, its tail holds another stream */
+		memset(ws->buf + OUICHEFS_COMPR_HDR + clen, 0,
+		       nr_compr * OUICHEFS_BLOCK_SIZE - OUICHEFS_COMPR_HDR -
+		       clen);
+		entries[0] = OUICHEFS_COMPR_ADDR;
+		ret = ouichefs_write_blocks(inode, &entries[1], ws->buf,
+					   nr_compr, false);
+	} else {
+		ret = ouichefs_write_blocks(inode, entries, buf, nr, true);
+	}
+	if (ws)
+		ouichefs_compr_put(sbi, algo, ws);
+	if (ret)
+		return ret;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index) {
+		inode->i_blocks -= ouichefs_put_cluster(sbi, entries);
+		return -EIO;
+	}
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	old = &index->blocks[c * OUICHEFS_CLUSTER_BLOCKS];
+	inode->i_blocks -= ouichefs_put_cluster(sbi, old);
+	memcpy(old, entries, sizeof(entries));
+	ouichefs_journal_dirty(sb, bh_index);
+	brelse(bh_index);
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * Copy the page-sized chunk of the cluster buffer buf that folio caches into
+ * it, and mark it uptodate.
+ */
+static void ouichefs_fill_folio(struct folio *folio, const char *buf)
+{
+	char *kaddr = kmap_local_folio(folio, 0);
+
+	memcpy(kaddr,
+	       buf + (folio->index % OUICHEFS_CLUSTER_BLOCKS) * PAGE_SIZE,
+	       PAGE_SIZE);
+	kunmap_local(kaddr);
+	flush_dcache_folio(folio);
+	folio_mark_uptodate(folio);
+}
+
+/*
+ * Read the locked folio of a compressed file through its cluster.
+ */
+static int ouichefs_compr_fill(struct folio *folio)
+{
+	char *buf;
+	int ret;
+
+	buf = kmalloc(OUICHEFS_CLUSTER_SIZE, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = ouichefs_read_cluster(folio->mapping->host,
+				    folio->index / OUICHEFS_CLUSTER_BLOCKS, buf);
+	if (!ret)
+		ouichefs_fill_folio(folio, buf);
+	kfree(buf);
+
+	return ret;
+}
+
+static int ouichefs_compr_read_folio(struct file *file, struct folio *folio)
+{
+	int ret = ouichefs_compr_fill(folio);
+
+	folio_unlock(folio);
+
+	return ret;
+}
+
+/*
+ * Called by the page cache to read ahead the pages of a compressed file. Each
+ * cluster is decompressed once, for all the pages it holds.
+ */
+static void ouichefs_compr_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct folio *folio;
+	pgoff_t c = ULONG_MAX;
+	char *buf;
+	int ret = 0;
+
+	buf = kmalloc(OUICHEFS_CLUSTER_SIZE, GFP_NOFS);
+
+	while ((folio = readahead_folio(rac)) != NULL) {
+		if (buf && folio->index / OUICHEFS_CLUSTER_BLOCKS != c) {
+			c = folio->index / OUICHEFS_CLUSTER_BLOCKS;
+			ret = ouichefs_read_cluster(inode, c, buf);
+		}
+		/* pages left !uptodate are read again by read_folio */
+		if (buf && !ret)
+			ouichefs_fill_folio(folio, buf);
+		folio_unlock(folio);
+	}
+
+	kfree(buf);
+}
+
+/*
+ * Write the c-th cluster of the file cached in mapping. Its cached pages are
+ * locked and cleaned, the missing ones are read from disk.
+ */
+static int ouichefs_write_cluster(struct address_space *mapping, pgoff_t c,
+				  struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct folio *folios[OUICHEFS_CLUSTER_BLOCKS];
+	bool complete = true, dirty[OUICHEFS_CLUSTER_BLOCKS];
+	char *buf, *kaddr;
+	int i, ret;
+
+	buf = kmalloc(OUICHEFS_CLUSTER_SIZE, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++) {
+		folios[i] = __filemap_get_folio(
+			mapping, c * OUICHEFS_CLUSTER_BLOCKS + i, FGP_LOCK, 0);
+		if (IS_ERR(folios[i]))
+			folios[i] = NULL;
+		if (!folios[i] || !folio_test_uptodate(folios[i]))
+			complete = false;
+	}
+
+	ret = 0;
+	if (!complete)
+		ret = ouichefs_read_cluster(inode, c, buf);
+
+	for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++) {
+		dirty[i] = false;
+		if (!folios[i] || !folio_test_uptodate(folios[i]))
+			continue;
+		if (!ret) {
+			kaddr = kmap_local_folio(folios[i], 0);
+			memcpy(buf + i * PAGE_SIZE, kaddr, PAGE_SIZE);
+			kunmap_local(kaddr);
+		}
+		dirty[i] = folio_clear_dirty_for_io(folios[i]);
+		if (dirty[i])
+			folio_start_writeback(folios[i]);
+	}
+
+	if (!ret)
+		ret = ouichefs_store_cluster(inode, c, buf);
+
+	for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++) {
+		if (!folios[i])
+			continue;
+		if (dirty[i]) {
+			/* the data stays dirty in memory if it was not stored */
+			if (ret)
+				folio_redirty_for_writepage(wbc, folios[i]);
+			folio_end_writeback(folios[i]);
+			wbc->nr_to_write--;
+		}
+		folio_unlock(folios[i]);
+		folio_put(folios[i]);
+	}
+	kfree(buf);
+
+	return ret;
+}
+
+/*
+ * Called by the page cache to write the dirty pages of a compressed file. The
+ * pages are written by whole clusters, each compressed once, and stored in a
+ * journal handle of its own.
+ */
+static int ouichefs_compr_writepages(struct address_space *mapping,
+				     struct writeback_control *wbc)
+{
+	struct super_block *sb = mapping->host->i_sb;
+	struct folio_batch fbatch;
+	pgoff_t index = 0, c = ULONG_MAX;
+	unsigned int i, nr;
+	struct ouichefs_handle handle;
+	int ret = 0;
+
+	folio_batch_init(&fbatch);
+	while (!ret && (nr = filemap_get_folios_tag(mapping, &index,
+						    (pgoff_t)-1,
+						    PAGECACHE_TAG_DIRTY,
+						    &fbatch))) {
+		for (i = 0; i < nr; i++) {
+			if (fbatch.folios[i]->index / OUICHEFS_CLUSTER_BLOCKS ==
+			    c)
+				continue;
+			c = fbatch.folios[i]->index / OUICHEFS_CLUSTER_BLOCKS;
+			ouichefs_journal_start(sb, &handle);
+			ret = ouichefs_write_cluster(mapping, c, wbc);
+			ouichefs_journal_stop(sb, &handle);
+			if (ret) {
+				mapping_set_error(mapping, ret);
+				break;
+			}
+			if (wbc->nr_to_write <= 0 &&
+			    wbc->sync_mode == WB_SYNC_NONE)
+				break;
+		}
+		folio_batch_release(&fbatch);
+		if (wbc->nr_to_write <= 0 && wbc->sync_mode == WB_SYNC_NONE)
+			break;
+		cond_resched();
+	}
+
+	return ret;
+}
+
+/*
+ * Called by the VFS before a write() copies data into the page cache. A page
+ * partially overwritten is read first, through its cluster.
+ */
+static int ouichefs_compr_write_begin(struct file *file,
+				     struct address_space *mapping, loff_t pos,
+				     unsigned int len, struct page **pagep,
+				     void **fsdata)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(mapping->host->i_sb);
+	struct folio *folio;
+	int ret, retries = 0;
+
+	if (pos + len > OUICHEFS_MAX_FILESIZE)
+		return -ENOSPC;
+	/* storing the cluster may take as many new blocks as it holds */
+	while (sbi->nr_free_blocks < OUICHEFS_CLUSTER_BLOCKS) {
+		if (!ouichefs_journal_retry(mapping->host->i_sb, -ENOSPC,
+					    &retries))
+			return -ENOSPC;
+	}
+
+	folio = __filemap_get_folio(mapping, pos >> PAGE_SHIFT, FGP_WRITEBEGIN,
+				    mapping_gfp_mask(mapping));
+	if (IS_ERR(folio))
+		return PTR_ERR(folio);
+
+	if (!folio_test_uptodate(folio) && len != PAGE_SIZE) {
+		ret = ouichefs_compr_fill(folio);
+		if (ret) {
+			folio_unlock(folio);
+			folio_put(folio);
+			return ret;
+		}
+	}
+	*pagep = &folio->page;
+
+	return 0;
+}
+
+static int ouichefs_compr_write_end(struct file *file,
+				   struct address_space *mapping, loff_t pos,
+				   unsigned int len, unsigned int copied,
+				   struct page *page, void *fsdata)
+{
+	struct folio *folio = page_folio(page);
+	struct inode *inode = mapping->host;
+	bool size_changed = false;
+
+	if (!folio_test_uptodate(folio)) {
+		/* a short copy into a page never read leaves garbage */
+		if (copied < len) {
+			copied = 0;
+			goto unlock;
+		}
+		folio_mark_uptodate(folio);
+	}
+
+	/* timestamps were updated by the caller, lazily under lazytime */
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		size_changed = true;
+	}
+	folio_mark_dirty(folio);
+unlock:
+	folio_unlock(folio);
+	folio_put(folio);
+
+	/* out of the folio lock, which comes after the journal handle */
+	if (size_changed)
+		mark_inode_dirty(inode);
+
+	return copied;
+}
+
+const struct address_space_operations ouichefs_compr_aops = {
+	.dirty_folio = filemap_dirty_folio,
+	.read_folio = ouichefs_compr_read_folio,
+	.readahead = ouichefs_compr_readahead,
+	.writepages = ouichefs_compr_writepages,
+	.write_begin = ouichefs_compr_write_begin,
+	.write_end = ouichefs_compr_write_end,
+};
+
+/*
+ * Resize a compressed file to size. The clusters past the new end of file are
+ * freed, the one holding it is stored again without its tail. Growing leaves a
+ * hole.
+ */
+int ouichefs_compr_truncate(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	pgoff_t c, first, last;
+	char *buf;
+	int ret;
+
+	/* nothing to free in a file without index block */
+	if (size >= inode->i_size || !OUICHEFS_INODE(inode)->index_block) {
+		truncate_setsize(inode, size);
+		return 0;
+	}
+
+	first = DIV_ROUND_UP(size, OUICHEFS_CLUSTER_SIZE);
+	last = DIV_ROUND_UP(inode->i_size, OUICHEFS_CLUSTER_SIZE);
+
+	/* the cluster holding the new end must be on disk to be cut */
+	ret = filemap_write_and_wait_range(inode->i_mapping,
+					   round_down(size,
+						      OUICHEFS_CLUSTER_SIZE),
+					   LLONG_MAX);
+	if (ret)
+		return ret;
+	truncate_setsize(inode, size);
+
+	if (size % OUICHEFS_CLUSTER_SIZE) {
+		buf = kmalloc(OUICHEFS_CLUSTER_SIZE, GFP_NOFS);
+		if (!buf)
+			return -ENOMEM;
+		c = size / OUICHEFS_CLUSTER_SIZE;
+		ret = ouichefs_read_cluster(inode, c, buf);
+		if (!ret)
+			ret = ouichefs_store_cluster(inode, c, buf);
+		kfree(buf);
+		if (ret)
+			return ret;
+	}
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	for (c = first; c < last; c++)
+		inode->i_blocks -= ouichefs_put_cluster(
+			OUICHEFS_SB(sb),
+			&index->blocks[c * OUICHEFS_CLUSTER_BLOCKS]);
+	ouichefs_journal_dirty(sb, bh_index);
+	brelse(bh_index);
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+const struct file_operations ouichefs_compr_file_ops = {
+	.owner = THIS_MODULE,
+	.open = ouichefs_file_open,
+	.release = ouichefs_file_release,
+	.llseek = generic_file_llseek,
+	.mmap = generic_file_mmap,
+	.read_iter = generic_file_read_iter,
+	.write_iter = generic_file_write_iter,
+	.splice_read = filemap_splice_read,
+	.splice_write = iter_file_splice_write,
+	.fsync = ouichefs_fsync,
+	.unlocked_ioctl = ouichefs_engine_ioctl,
+};
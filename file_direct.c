@@ -0,0 +1,335 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/uaccess.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+#include "ioctl.h"
+
+static ssize_t ouichefs_direct_read(struct file *file,
+			char __user *buf, size_t count, loff_t *pos)
+{
+	if (*pos >= file->f_inode->i_size)
+		return 0;
+
+	/* update atime like the generic read paths, if the mount allows it */
+	file_accessed(file);
+
+	unsigned long to_be_copied = 0;
+	unsigned long copied_to_user = 0;
+
+	struct super_block *sb = file->f_inode->i_sb;
+	sector_t iblock = *pos / OUICHEFS_BLOCK_SIZE;
+	struct ouichefs_file_index_block *index = NULL;
+	struct buffer_head *bh_index = NULL;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file->f_inode);
+
+	/* If block number exceeds filesize, fail */
+	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
+		return -EFBIG;
+
+	/* Read index block from disk, a file without one is a hole */
+	if (ci->index_block) {
+		bh_index = sb_bread(sb, ci->index_block);
+		if (!bh_index)
+			return -EIO;
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	}
+
+	/* Get the block number for the current iblock */
+
+	int bno = index ? index->blocks[iblock] : 0;
+	int bnum = (bno & BLOCK_NUMBER_MASK);
+	size_t offset = *pos % OUICHEFS_BLOCK_SIZE;
+
+	/* copy up to the end of the block or of the file */
+	to_be_copied = min_t(size_t, count, OUICHEFS_BLOCK_SIZE - offset);
+	to_be_copied = min_t(size_t, to_be_copied,
+			     file->f_inode->i_size - *pos);
+
+	/* a hole reads as zeros */
+	if (bnum == 0) {
+		brelse(bh_index);
+		copied_to_user = to_be_copied - clear_user(buf, to_be_copied);
+		if (!copied_to_user)
+			return -EFAULT;
+		*pos += copied_to_user;
+		file->f_pos = *pos;
+		return copied_to_user;
+	}
+
+	struct buffer_head *bh = sb_bread(sb, bnum);
+
+	if (!bh) {
+		brelse(bh_index);
+		return -EIO;
+	}
+
+	char *buffer = bh->b_data;
+
+	/* get data from the buffer from the current position */
+	buffer += offset;
+
+	copied_to_user = to_be_copied - copy_to_user(buf, buffer, to_be_copied);
+
+	*pos += copied_to_user;
+	file->f_pos = *pos;
+
+	brelse(bh);
+	brelse(bh_index);
+
+	return copied_to_user;
+}
+
+/* Called in a journal handle, by ouichefs_direct_write() */
+static ssize_t __ouichefs_direct_write(struct file *filep,
+		const char __user *buf, size_t len, loff_t *ppos)
+{
+	struct inode *inode = filep->f_inode;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ii = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh;
+	char *buffer;
+	size_t to_write, written = 0;
+	sector_t iblock;
+	int bno;
+	bool fresh;
+	size_t offset;
+	size_t remaining;
+	int ret;
+
+	if (filep->f_flags & O_APPEND)
+		*ppos = inode->i_size;
+
+	if (*ppos >= OUICHEFS_MAX_FILESIZE)
+		return -EFBIG;
+
+	/* only marks the inode dirty for its timestamps under lazytime */
+	ret = file_update_time(filep);
+	if (ret)
+		return ret;
+
+	ret = ouichefs_alloc_index(inode);
+	if (ret)
+		return ret;
+
+	/* blocks between the end of file and *ppos are left as a hole */
+	while (len > 0) {
+		bh_index = sb_bread(sb, ii->index_block);
+		if (!bh_index)
+			return written ? written : -EIO;
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+		iblock = *ppos / OUICHEFS_BLOCK_SIZE;
+		fresh = index->blocks[iblock] == 0;
+		/* Vérifier si le bloc est déjà alloué */
+		if (fresh) {
+			/* Allouer un nouveau bloc */
+			bno = get_free_block(OUICHEFS_SB(sb),
+					     ii->index_block + 1 + iblock);
+			bno = (0 << 20) | (bno & BLOCK_NUMBER_MASK);
+			if (!bno) {
+				brelse(bh_index);
+				return written ? written : -ENOSPC;
+			}
+			inode->i_blocks++;
+			index->blocks[iblock] = bno;
+			ouichefs_journal_dirty(sb, bh_index);
+		} else {
+			bno = index->blocks[iblock];
+		}
+
+		/*
+		 * Lire ou initialiser le bloc de données. The rest of a block
+		 * filling a hole must read as zeros: it is zeroed in memory
+		 * instead of being read from disk.
+		 */
+		if (fresh)
+			bh = ouichefs_new_block(sb, bno & BLOCK_NUMBER_MASK);
+		else
+			bh = sb_bread(sb, bno & BLOCK_NUMBER_MASK);
+		if (!bh) {
+			brelse(bh_index);
+			return -EIO;
+		}
+		buffer = bh->b_data;
+
+		/* Calculer la quantité de données
+		 * à écrire dans ce bloc */
+		offset = *ppos % OUICHEFS_BLOCK_SIZE;
+		remaining = OUICHEFS_BLOCK_SIZE - offset;
+		to_write = min(len, remaining);
+
+		/* Copier les données de l'utilisateur
+		 * dans le bloc de données */
+		if (copy_from_user(buffer + offset, buf, to_write)) {
+			brelse(bh);
+			brelse(bh_index);
+			return -EFAULT;
+		}
+
+		/* written before the commit of the index */
+		mark_buffer_dirty(bh);
+		brelse(bh);
+
+		uint32_t bnum20 = (bno & BLOCK_NUMBER_MASK);
+		uint32_t bsize12 = (bno & BLOCK_SIZE_MASK) >> 20;
+
+		bsize12 += written;
+		index->blocks[iblock] = (bsize12 << 20)
+			| (bnum20 & BLOCK_NUMBER_MASK);
+
+		ouichefs_journal_dirty(sb, bh_index);
+		brelse(bh_index);
+
+		*ppos += to_write;
+		buf += to_write;
+		len -= to_write;
+		written += to_write;
+
+		/* Mettre à jour la taille du fichier si nécessaire */
+		if (*ppos > inode->i_size) {
+			inode->i_size = *ppos;
+			mark_inode_dirty(inode);
+		}
+	}
+
+	return written;
+}
+
+static ssize_t ouichefs_direct_write(struct file *filep,
+		const char __user *buf, size_t len, loff_t *ppos)
+{
+	struct super_block *sb = filep->f_inode->i_sb;
+	struct ouichefs_handle handle;
+	ssize_t ret;
+	int retries = 0;
+
+	do {
+		ouichefs_journal_start(sb, &handle);
+		ret = __ouichefs_direct_write(filep, buf, len, ppos);
+		ouichefs_journal_stop(sb, &handle);
+	} while (ouichefs_journal_retry(sb, ret, &retries));
+
+	return ret;
+}
+
+static long ouichefs_direct_ioctl(struct file *file,
+	unsigned int cmd, unsigned long arg)
+{
+	if (_IOC_TYPE(cmd) != OUICHEFS_IOC_MAGIC) {
+		pr_info("Invalid type\n");
+		return -ENOTTY;
+	}
+
+	struct super_block *sb = file->f_inode->i_sb;
+	struct inode *inode = file->f_inode;
+	struct ouichefs_inode_info *ii = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_index;
+	int used_blocks = 0;
+	int partial_blocks = 0;
+	int internal_frag = 0;
+
+	struct ouichefs_file_index_block *index = NULL;
+
+	/* a file without index block has no block to report */
+	bh_index = NULL;
+	if (ii->index_block) {
+		bh_index = sb_bread(sb, ii->index_block);
+		if (!bh_index) {
+			pr_err("Failed to read index block\n");
+			return -EIO;
+		}
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	}
+
+	used_blocks = inode->i_blocks;
+
+	for (int i = 0; index && i < inode->i_blocks; i++) {
+		uint32_t sizeb = (index->blocks[i] >> 20);
+
+		if (sizeb < OUICHEFS_BLOCK_SIZE) {
+			partial_blocks++;
+			internal_frag += (OUICHEFS_BLOCK_SIZE - sizeb);
+		}
+	}
+	brelse(bh_index);
+	char ret[64];
+
+	switch (cmd) {
+	case USED_BLOCKS:
+		snprintf(ret, sizeof(used_blocks), "%d", used_blocks);
+		if (copy_to_user((char *)arg, ret, sizeof(ret))) {
+			pr_info("ouiche_ioctl: copy_to_user failed\n");
+			return -EFAULT;
+		}
+		return 0;
+	case PARTIAL_BLOCKS:
+		snprintf(ret, sizeof(partial_blocks), "%d", partial_blocks);
+		if (copy_to_user((char *)arg, ret, sizeof(ret))) {
+			pr_info("ouiche_ioctl: copy_to_user failed\n");
+			return -EFAULT;
+		}
+		return 0;
+	case INTERNAL_FRAG:
+		snprintf(ret, sizeof(internal_frag), "%d", internal_frag);
+		if (copy_to_user((char *)arg, ret, sizeof(ret))) {
+			pr_info("ouiche_ioctl: copy_to_user failed\n");
+			return -EFAULT;
+		}
+		return 0;
+	case USED_BLOCKS_INFO:
+		if (!ii->index_block)
+			return 0;
+		bh_index = sb_bread(sb, ii->index_block);
+		if (!bh_index)
+			return -EIO;
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+		for (int i = 0; i < inode->i_blocks; i++) {
+			uint32_t bn = (index->blocks[i] & 0x000FFFFF);
+
+			if (bn == 0)
+				continue;
+
+			struct buffer_head *bh = sb_bread(sb, bn);
+			uint32_t size = (index->blocks[i] & BLOCK_SIZE_MASK)
+				>> 20;
+
+			pr_info("block number : %d  size : %d\n", bn, size);
+			brelse(bh);
+		}
+
+		brelse(bh_index);
+		return 0;
+	default:
+		return ouichefs_engine_ioctl(file, cmd, arg);
+	}
+	return 0;
+}
+
+const struct file_operations ouichefs_direct_file_ops = {
+	.owner = THIS_MODULE,
+	.open = ouichefs_file_open,
+	.release = ouichefs_file_release,
+	.llseek = ouichefs_llseek,
+	.fallocate = ouichefs_fallocate,
+	.read = ouichefs_direct_read,
+	.read_iter = generic_file_read_iter,
+	.write = ouichefs_direct_write,
+	.write_iter = generic_file_write_iter,
+	.fsync = ouichefs_fsync,
+	.unlocked_ioctl = ouichefs_direct_ioctl
+};
@@ -0,0 +1,1470 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+#include "ioctl.h"
+
+/*
+ * Cache the position of the tail of the file (number of used index entries and
+ * number of bytes they hold), so that appends do not have to walk the index.
+ */
+static void ouichefs_load_tail(struct inode *inode,
+			       struct ouichefs_file_index_block *index)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	sector_t iblock;
+	loff_t end = 0;
+
+	for (iblock = 0; iblock < (OUICHEFS_BLOCK_SIZE >> 2) &&
+			 index->blocks[iblock] != 0;
+	     iblock++)
+		end += (index->blocks[iblock] & BLOCK_SIZE_MASK) >> 20;
+
+	ci->tail_nr = iblock;
+	ci->tail_end = end;
+	ci->tail_valid = true;
+}
+
+/*
+ * The page cache of a variable-size block file only holds clean copies of the
+ * data on disk, filled by ouichefs_varblock_read_folio(). Drop the pages
+ * covering [start, end) once new data was written there.
+ */
+static void ouichefs_varblock_invalidate(struct inode *inode, loff_t start,
+					 loff_t end)
+{
+	if (end <= start || !inode->i_mapping->nrpages)
+		return;
+
+	invalidate_inode_pages2_range(inode->i_mapping, start >> PAGE_SHIFT,
+				      (end - 1) >> PAGE_SHIFT);
+}
+
+/*
+ * Give the hole described by the iblock-th entry of index a zeroed block, so
+ * that data can be written into it. The size of the entry is kept. Caller must
+ * mark the index block dirty.
+ */
+static int ouichefs_fill_hole(struct inode *inode,
+			      struct ouichefs_file_index_block *index,
+			      sector_t iblock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	uint32_t bnum20;
+
+	bnum20 = get_free_block(OUICHEFS_SB(sb),
+				OUICHEFS_INODE(inode)->index_block);
+	if (!bnum20)
+		return -ENOSPC;
+
+	bh = ouichefs_new_block(sb, bnum20);
+	if (!bh) {
+		put_block(OUICHEFS_SB(sb), bnum20);
+		return -ENOMEM;
+	}
+	brelse(bh);
+
+	index->blocks[iblock] |= bnum20;
+	inode->i_blocks++;
+
+	return 0;
+}
+
+/*
+ * Write the data of from at offset pos of the file, without ever splitting a
+ * block. Bytes that fall inside the data already on disk are overwritten in
+ * place in the blocks holding them. The rest is merged into the free space of
+ * the last partial block, and new blocks are only allocated once it is full.
+ * A hole written into gets a block of its own. A gap between the end of the
+ * data on disk and pos becomes a hole, even if from is empty.
+ * Writes starting past the end of the data on disk go straight to the tail.
+ * Caller must hold a journal handle and wcb_lock.
+ */
+static int ouichefs_commit(struct inode *inode, loff_t pos,
+			   struct iov_iter *from)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh;
+	uint32_t bnum20, bsize12;
+	sector_t iblock, cur;
+	loff_t start = 0; /* file offset of the first byte of iblock */
+	loff_t first = pos;
+	size_t boff, n;
+	int ret;
+
+	ret = ouichefs_alloc_index(inode);
+	if (ret)
+		return ret;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	if (!ci->tail_valid)
+		ouichefs_load_tail(inode, index);
+
+	/* appending: skip the blocks before the tail */
+	iblock = 0;
+	if (pos >= ci->tail_end) {
+		iblock = ci->tail_nr;
+		start = ci->tail_end;
+	}
+
+	/* overwrite the bytes that are already stored on disk */
+	for (; iblock < ci->tail_nr; iblock++) {
+		bsize12 = (index->blocks[iblock] & BLOCK_SIZE_MASK) >> 20;
+		bnum20 = index->blocks[iblock] & BLOCK_NUMBER_MASK;
+
+		if (iov_iter_count(from) > 0 && pos < start + bsize12) {
+			boff = pos - start;
+			n = min_t(size_t, bsize12 - boff, iov_iter_count(from));
+
+			if (!bnum20) {
+				ret = ouichefs_fill_hole(inode, index, iblock);
+				if (ret)
+					goto dirty_index;
+				bnum20 = index->blocks[iblock] &
+					 BLOCK_NUMBER_MASK;
+			}
+
+			/* a hole filled above is in the index already */
+			bh = sb_bread(sb, bnum20);
+			if (!bh) {
+				ret = -EIO;
+				goto dirty_index;
+			}
+			if (copy_from_iter(bh->b_data + boff, n, from) != n)
+				ret = -EFAULT;
+			mark_buffer_dirty(bh);
+			brelse(bh);
+			if (ret)
+				goto dirty_index;
+
+			pos += n;
+		}
+		start += bsize12;
+	}
+
+	/* append the rest to the tail, filling the last block first */
+	while (iov_iter_count(from) > 0 || pos > start) {
+		/* a gap before pos: grow the trailing hole or start one */
+		if (pos > start) {
+			if (iblock > 0 &&
+			    !(index->blocks[iblock - 1] & BLOCK_NUMBER_MASK) &&
+			    ((index->blocks[iblock - 1] & BLOCK_SIZE_MASK) >>
+			     20) < OUICHEFS_BLOCK_SIZE - 1) {
+				cur = iblock - 1;
+			} else {
+				if (iblock == (OUICHEFS_BLOCK_SIZE >> 2)) {
+					ret = -ENOSPC;
+					goto dirty_index;
+				}
+				index->blocks[iblock] = 0;
+				cur = iblock++;
+				ci->tail_nr = iblock;
+			}
+			bsize12 = (index->blocks[cur] & BLOCK_SIZE_MASK) >> 20;
+			n = min_t(size_t, (OUICHEFS_BLOCK_SIZE - 1) - bsize12,
+				  pos - start);
+			index->blocks[cur] = (bsize12 + n) << 20;
+			start += n;
+			ci->tail_end = start;
+			continue;
+		}
+
+		if (iblock > 0 &&
+		    (index->blocks[iblock - 1] & BLOCK_NUMBER_MASK) &&
+		    ((index->blocks[iblock - 1] & BLOCK_SIZE_MASK) >> 20) <
+			    OUICHEFS_BLOCK_SIZE - 1) {
+			cur = iblock - 1;
+		} else {
+			if (iblock == (OUICHEFS_BLOCK_SIZE >> 2)) {
+				ret = -ENOSPC;
+				goto dirty_index;
+			}
+			bnum20 = get_free_block(OUICHEFS_SB(sb),
+						ci->index_block);
+			if (!bnum20) {
+				ret = -ENOSPC;
+				goto dirty_index;
+			}
+			index->blocks[iblock] = bnum20;
+			inode->i_blocks++;
+			cur = iblock++;
+			ci->tail_nr = iblock;
+		}
+		bsize12 = (index->blocks[cur] & BLOCK_SIZE_MASK) >> 20;
+		bnum20 = index->blocks[cur] & BLOCK_NUMBER_MASK;
+
+		bh = sb_bread(sb, bnum20);
+		if (!bh) {
+			ret = -EIO;
+			goto dirty_index;
+		}
+
+		n = min_t(size_t, (OUICHEFS_BLOCK_SIZE - 1) - bsize12,
+			  iov_iter_count(from));
+		n = copy_from_iter(bh->b_data + bsize12, n, from);
+		if (!n)
+			ret = -EFAULT;
+		pos += n;
+		mark_buffer_dirty(bh);
+		brelse(bh);
+
+		bsize12 += n;
+		start += n;
+		ci->tail_end = start;
+		index->blocks[cur] = (bsize12 << 20) | bnum20;
+		if (ret)
+			goto dirty_index;
+	}
+
+dirty_index:
+	ouichefs_journal_dirty(sb, bh_index);
+	mark_inode_dirty(inode);
+	brelse(bh_index);
+	ouichefs_varblock_invalidate(inode, first, pos);
+
+	return ret;
+}
+
+/*
+ * Commit the small writes staged in the write-combining buffer of inode.
+ * Caller must hold wcb_lock.
+ */
+static int __ouichefs_flush_wcb(struct inode *inode)
+{
+	struct ouichefs_wcb *wcb = OUICHEFS_INODE(inode)->wcb;
+	struct kvec kv;
+	struct iov_iter from;
+	int ret;
+
+	if (!wcb || wcb->len == 0)
+		return 0;
+
+	kv.iov_base = wcb->data;
+	kv.iov_len = wcb->len;
+	iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, wcb->len);
+	ret = ouichefs_commit(inode, wcb->pos, &from);
+	if (!ret)
+		wcb->len = 0;
+
+	return ret;
+}
+
+/*
+ * Commit the staged writes of inode, if any. Also called by the journal commit,
+ * so that the size they gave the file is never committed without them.
+ */
+int ouichefs_flush_wcb(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_handle handle;
+	int ret;
+
+	ouichefs_journal_start(inode->i_sb, &handle);
+	mutex_lock(&ci->wcb_lock);
+	ret = __ouichefs_flush_wcb(inode);
+	mutex_unlock(&ci->wcb_lock);
+	ouichefs_journal_stop(inode->i_sb, &handle);
+
+	return ret;
+}
+
+/*
+ * Resize a variable-size block file to size. Shrinking cuts the block holding
+ * the new end of file and frees every block after it, growing leaves a hole.
+ */
+int ouichefs_varblock_truncate(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	struct iov_iter from;
+	uint32_t bsize12;
+	sector_t iblock;
+	loff_t start = 0; /* file offset of the first byte of iblock */
+	int ret;
+
+	/* staged writes are committed first, then cut like the rest */
+	mutex_lock(&ci->wcb_lock);
+	ret = __ouichefs_flush_wcb(inode);
+	if (ret)
+		goto unlock;
+
+	if (size >= inode->i_size) {
+		iov_iter_kvec(&from, ITER_SOURCE, NULL, 0, 0);
+		ret = ouichefs_commit(inode, size, &from);
+		if (!ret)
+			truncate_setsize(inode, size);
+		goto unlock;
+	}
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
+	}
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	if (!ci->tail_valid)
+		ouichefs_load_tail(inode, index);
+
+	/* find the block holding the new end of file */
+	for (iblock = 0; iblock < ci->tail_nr; iblock++) {
+		bsize12 = (index->blocks[iblock] & BLOCK_SIZE_MASK) >> 20;
+		if (start + bsize12 > size)
+			break;
+		start += bsize12;
+	}
+	if (iblock < ci->tail_nr && size > start) {
+		index->blocks[iblock] = ((size - start) << 20) |
+					(index->blocks[iblock] &
+					 BLOCK_NUMBER_MASK);
+		iblock++;
+	}
+
+	inode->i_blocks -= put_index_blocks(OUICHEFS_SB(sb),
+					    &index->blocks[iblock],
+					    ci->tail_nr - iblock,
+					    BLOCK_NUMBER_MASK);
+	ci->tail_nr = iblock;
+	ci->tail_end = size;
+
+	ouichefs_journal_dirty(sb, bh_index);
+	brelse(bh_index);
+	truncate_setsize(inode, size);
+unlock:
+	mutex_unlock(&ci->wcb_lock);
+
+	return ret;
+}
+
+/*
+ * Punch a hole in [start, end) of a variable-size block file. The blocks fully
+ * inside the range are freed and their entries become holes of the same size,
+ * so that no data moves. The partial blocks at its edges are zeroed.
+ */
+int ouichefs_varblock_punch(struct inode *inode, loff_t start, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	uint32_t bnum20, bsize12, run = 0, len = 0;
+	sector_t iblock;
+	loff_t bstart, pos = 0;
+	int ret;
+
+	/* staged writes in the range must be punched too */
+	mutex_lock(&ci->wcb_lock);
+	ret = __ouichefs_flush_wcb(inode);
+	if (ret)
+		goto unlock;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
+	}
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	if (!ci->tail_valid)
+		ouichefs_load_tail(inode, index);
+
+	for (iblock = 0; iblock < ci->tail_nr && pos < end; iblock++) {
+		bsize12 = (index->blocks[iblock] & BLOCK_SIZE_MASK) >> 20;
+		bnum20 = index->blocks[iblock] & BLOCK_NUMBER_MASK;
+		bstart = pos;
+		pos += bsize12;
+		if (pos <= start || !bnum20 || !bsize12)
+			continue;
+
+		if (bstart >= start && pos <= end) {
+			index->blocks[iblock] = bsize12 << 20;
+			inode->i_blocks--;
+			put_block_run(OUICHEFS_SB(sb), &run, &len, bnum20);
+		} else {
+			ret = ouichefs_zero_block(sb, bnum20,
+						  max(start, bstart) - bstart,
+						  min(end, pos) - bstart);
+			if (ret)
+				break;
+		}
+	}
+	put_block_run(OUICHEFS_SB(sb), &run, &len, 0);
+
+	ouichefs_journal_dirty(sb, bh_index);
+	brelse(bh_index);
+unlock:
+	mutex_unlock(&ci->wcb_lock);
+
+	return ret;
+}
+
+/*
+ * Return the offset of the first data (SEEK_DATA) or hole (SEEK_HOLE) byte at
+ * or after offset in a variable-size block file. Staged writes are committed
+ * first, then only the index block is read.
+ */
+loff_t ouichefs_varblock_seek_hole_data(struct inode *inode, loff_t offset,
+					int whence)
+{
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	uint32_t bsize12;
+	sector_t iblock;
+	loff_t start = 0; /* file offset of the first byte of iblock */
+	int ret;
+
+	if (offset < 0 || offset >= inode->i_size)
+		return -ENXIO;
+
+	ret = ouichefs_flush_wcb(inode);
+	if (ret)
+		return ret;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(inode->i_sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	for (iblock = 0; iblock < (OUICHEFS_BLOCK_SIZE >> 2) &&
+			 index->blocks[iblock] != 0;
+	     iblock++) {
+		bsize12 = (index->blocks[iblock] & BLOCK_SIZE_MASK) >> 20;
+		if (start + bsize12 > offset &&
+		    !!(index->blocks[iblock] & BLOCK_NUMBER_MASK) ==
+			    (whence == SEEK_DATA))
+			break;
+		start += bsize12;
+	}
+	brelse(bh_index);
+
+	start = max_t(loff_t, offset, start);
+	if (start >= inode->i_size)
+		return whence == SEEK_DATA ? -ENXIO : inode->i_size;
+
+	return start;
+}
+
+/*
+ * Stage a small write in the write-combining buffer of inode. A write that
+ * overlaps or directly follows the staged range is merged with it, any other
+ * write commits the staged data first. Caller must hold wcb_lock.
+ */
+static ssize_t ouichefs_stage_write(struct inode *inode,
+				    const char __user *buf, size_t len,
+				    loff_t *ppos)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_wcb *wcb;
+	int ret;
+
+	if (!ci->wcb) {
+		ci->wcb = kzalloc(sizeof(struct ouichefs_wcb), GFP_KERNEL);
+		if (!ci->wcb)
+			return -ENOMEM;
+	}
+	wcb = ci->wcb;
+
+	/* the write cannot be merged with the staged range */
+	if (wcb->len > 0 &&
+	    (*ppos < wcb->pos || *ppos > wcb->pos + wcb->len ||
+	     *ppos + len > wcb->pos + OUICHEFS_WCB_SIZE)) {
+		ret = __ouichefs_flush_wcb(inode);
+		if (ret)
+			return ret;
+	}
+	if (wcb->len == 0)
+		wcb->pos = *ppos;
+
+	if (copy_from_user(wcb->data + (*ppos - wcb->pos), buf, len))
+		return -EFAULT;
+	wcb->len = max_t(size_t, wcb->len, *ppos + len - wcb->pos);
+
+	/* update variables, timestamps are the caller's */
+	*ppos += len;
+	if (*ppos > inode->i_size) {
+		i_size_write(inode, *ppos);
+		mark_inode_dirty(inode);
+	}
+	/* the next commit, which logs that size, commits the staged data */
+	ouichefs_journal_add_inode(inode);
+
+	return len;
+}
+
+/* The return value of release is lost: a flush error is left for fsync() */
+static int ouichefs_varblock_release(struct inode *inode, struct file *file)
+{
+	int ret = ouichefs_flush_wcb(inode);
+
+	if (ret)
+		mapping_set_error(inode->i_mapping, ret);
+	ouichefs_file_release(inode, file);
+
+	return ret;
+}
+
+/* Staged writes are committed first, to be synced with the rest */
+static int ouichefs_varblock_fsync(struct file *file, loff_t start, loff_t end,
+				   int datasync)
+{
+	int ret = ouichefs_flush_wcb(file_inode(file));
+
+	if (ret)
+		return ret;
+
+	return ouichefs_fsync(file, start, end, datasync);
+}
+
+static ssize_t ouichefs_varblock_read(struct file *file,
+			char __user *buf, size_t count, loff_t *pos)
+{
+	if (*pos >= file->f_inode->i_size)
+		return 0;
+
+	/* update atime like the generic read paths, if the mount allows it */
+	file_accessed(file);
+
+	/* staged writes must be visible to the reader */
+	int ret = ouichefs_flush_wcb(file->f_inode);
+
+	if (ret)
+		return ret;
+
+	unsigned long to_be_copied = 0;
+	unsigned long copied_to_user = 0;
+
+	struct super_block *sb = file->f_inode->i_sb;
+	sector_t iblock = *pos / OUICHEFS_BLOCK_SIZE;
+	size_t offset, bsize12, bnum20;
+	int bno;
+
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file->f_inode);
+
+	/* If block number exceeds filesize, fail */
+	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
+		return -EFBIG;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	/* get iblock with offset associated to pos */
+	offset = *pos;
+	for (iblock = 0; iblock < (OUICHEFS_BLOCK_SIZE>>2);
+		iblock++) {
+		bno = index->blocks[iblock];
+		bsize12 = (bno & BLOCK_SIZE_MASK) >> 20;
+		if (bno == 0) {
+			brelse(bh_index);
+			return -EIO;
+		}
+		if (bsize12 > offset
+			|| index->blocks[iblock+1] == 0) {
+			break;
+		}
+		offset -= (size_t) bsize12;
+	}
+
+	/* Get the block number for the current iblock */
+	bno = index->blocks[iblock];
+	bsize12 = (bno & BLOCK_SIZE_MASK) >> 20;
+	bnum20 = bno & BLOCK_NUMBER_MASK;
+
+	/* block must exist */
+	if (bno == 0 || offset >= bsize12) {
+		brelse(bh_index);
+		return -EIO;
+	}
+
+	/* copy up to the end of the block */
+	to_be_copied = min_t(size_t, count, bsize12 - offset);
+
+	/* a hole reads as zeros */
+	if (bnum20 == 0) {
+		brelse(bh_index);
+		copied_to_user = to_be_copied - clear_user(buf, to_be_copied);
+		if (!copied_to_user)
+			return -EFAULT;
+		*pos += copied_to_user;
+		file->f_pos = *pos;
+		return copied_to_user;
+	}
+
+	/* get the block */
+	struct buffer_head *bh = sb_bread(sb, bnum20);
+
+	if (!bh) {
+		brelse(bh_index);
+		return -EIO;
+	}
+
+	char *buffer = bh->b_data;
+
+	/* shift buffer pointer */
+	buffer += offset;
+
+	/* copy to user */
+	copied_to_user = to_be_copied
+			- copy_to_user(buf, buffer, to_be_copied);
+
+	/* update variables */
+	*pos += copied_to_user;
+	file->f_pos = *pos;
+
+	brelse(bh);
+	brelse(bh_index);
+
+	return copied_to_user;
+}
+
+static ssize_t ouichefs_split_write(struct file *filep,
+				const char __user *buf,
+				size_t len, loff_t *ppos)
+{
+	struct inode *inode = filep->f_inode;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ii = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh;
+	char *buffer;
+	size_t to_write, written = 0;
+	sector_t iblock;
+	int bno, ret;
+	uint32_t bnum20, bsize12;
+	size_t offset, remaining;
+
+	/* adding at the end of the file*/
+	if (filep->f_flags & O_APPEND)
+		*ppos = inode->i_size;
+
+	/* adding more than max filesize  */
+	if (*ppos >= OUICHEFS_MAX_FILESIZE)
+		return -EFBIG;
+
+	ret = ouichefs_alloc_index(inode);
+	if (ret)
+		return ret;
+
+	/* Read index block from disk */
+	bh_index = sb_bread(sb, ii->index_block);
+	if (!bh_index)
+		return -EIO;
+
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	/* blocks are allocated and shifted below */
+	ii->tail_valid = false;
+
+	/* searching iblock associated to ppos and calculate offset */
+	offset = *ppos;
+	for (iblock = 0;
+		iblock < (OUICHEFS_BLOCK_SIZE>>2) || offset == 0;
+		iblock++) {
+
+		/* block does not exist: leave a hole up to the position */
+		if (index->blocks[iblock] == 0) {
+			bnum20 = 0;
+			bsize12 = min(offset, (size_t) (OUICHEFS_BLOCK_SIZE-1));
+			bno = bsize12 << 20;
+			index->blocks[iblock] = bno;
+			ouichefs_journal_dirty(sb, bh_index);
+		} else {
+			/* block exist */
+			bno = index->blocks[iblock];
+			bsize12 = (bno & BLOCK_SIZE_MASK) >> 20;
+			bnum20 = bno & BLOCK_NUMBER_MASK;
+		}
+		/* found a block that can contain our data */
+		/*  we are the last block*/
+		if (bsize12 >= offset
+			|| index->blocks[iblock+1] == 0)
+			break;
+		/* update our remaining offset
+			before to reach pos */
+		offset -= bsize12;
+	}
+	/* reached the max block size */
+	if (iblock == (OUICHEFS_BLOCK_SIZE>>2)) {
+		brelse(bh_index);
+		return -ENOSPC;
+	}
+
+    /* variables for splitting our block */
+	int bno1, bno2, currentBlock, precBlock = 0;
+	uint32_t b1num20, b1size12, b2num20, b2size12;
+	struct buffer_head *bh_bno1, *bh_bno2;
+
+	/* the data of a hole is about to be split or written */
+	if (!(index->blocks[iblock] & BLOCK_NUMBER_MASK)) {
+		int err = ouichefs_fill_hole(inode, index, iblock);
+
+		if (err) {
+			brelse(bh_index);
+			return err;
+		}
+		ouichefs_journal_dirty(sb, bh_index);
+	}
+
+	/* block that will be divised transfered */
+	bno1 = index->blocks[iblock];
+	b1num20 = bno1 & BLOCK_NUMBER_MASK;
+	b1size12 = (bno1 & BLOCK_SIZE_MASK) >> 20;
+
+    /* shift blocks if next blocks are not empty */
+	precBlock = index->blocks[iblock+1];
+	for (int i = iblock+2;
+		i < (OUICHEFS_BLOCK_SIZE >> 2);
+		i++) {
+		if (precBlock == 0)
+			break;
+		currentBlock = index->blocks[i];
+		index->blocks[i] = precBlock;
+		precBlock = currentBlock;
+		ouichefs_journal_dirty(sb, bh_index);
+	}
+
+	/* separate the block into two blocks */
+	if (offset != 0) {
+		ii->nr_splits++;
+
+		/* allocate new bloc */
+		b2num20 = get_free_block(OUICHEFS_SB(sb), ii->index_block);
+		b2size12 = 0;
+		bno2 = (b2size12 << 20) | b2num20;
+		if (!b2num20) {
+			brelse(bh_index);
+			return -ENOSPC;
+		}
+		inode->i_blocks++;
+		index->blocks[iblock+1] = bno2;
+		ouichefs_journal_dirty(sb, bh_index);
+
+		/* get the two blocks */
+		bh_bno1 = sb_bread(sb, b1num20);
+		if (!bh_bno1) {
+			brelse(bh_index);
+			return -EIO;
+		}
+		bh_bno2 = sb_bread(sb, b2num20);
+		if (!bh_bno2) {
+			brelse(bh_bno1);
+			brelse(bh_index);
+			return -EIO;
+		}
+
+		/* calculate bytes to transfer into the new block */
+		if ((size_t) b1size12 > offset)
+			remaining = (size_t) b1size12 - offset;
+		else
+			/* offset is out of the block size */
+			remaining = 0;
+
+		/* transfer data into the 2nd blocks */
+		memcpy(bh_bno2->b_data, bh_bno1->b_data + offset, remaining);
+		mark_buffer_dirty(bh_bno2);
+
+		/* update block size */
+		b1size12 = offset; /* start of block until offset */
+		b2size12 = remaining; /* offset to end of the old block */
+		bno1 = b1size12 << 20 | b1num20;
+		bno2 = b2size12 << 20 | b2num20;
+		index->blocks[iblock] = bno1;
+		index->blocks[iblock+1] = bno2;
+		ouichefs_journal_dirty(sb, bh_index);
+		brelse(bh_bno1);
+		brelse(bh_bno2);
+		iblock += 1;
+		offset = 0;
+	}
+
+	/* write until no space or all written */
+	while (len > 0 && iblock != (OUICHEFS_BLOCK_SIZE>>2)) {
+		bh_index = sb_bread(sb, ii->index_block);
+		if (!bh_index) {
+			pr_err("Failed to read index block\n");
+			return -EIO;
+		}
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+		bno = index->blocks[iblock];
+
+		/* the block not exists */
+		if (!bno) {
+			/* allocate new blocK */
+			bnum20 = get_free_block(OUICHEFS_SB(sb),
+						ii->index_block);
+			if (!bnum20) {
+				brelse(bh_index);
+				return -ENOSPC;
+			}
+			/* prepare to_write len or max block size */
+			remaining = (size_t) (OUICHEFS_BLOCK_SIZE - 1)
+					- offset;
+			to_write = min_t(size_t, remaining,
+					len);
+			bsize12 = to_write;
+			/* allocated size for the writing */
+			bno = (bsize12 << 20) | bnum20;
+			index->blocks[iblock] = bno;
+			inode->i_blocks++;
+			ouichefs_journal_dirty(sb, bh_index);
+		} else {
+			/* block exists */
+			/* write len or block size */
+			bsize12 = (bno & BLOCK_SIZE_MASK) >> 20;
+			to_write = min_t(size_t, bsize12, len);
+		    	bnum20 = bno & BLOCK_NUMBER_MASK;
+			if (!bnum20) {
+				/* writing into a hole */
+				int err = ouichefs_fill_hole(inode, index,
+							     iblock);
+
+				if (err) {
+					brelse(bh_index);
+					return written ? written : err;
+				}
+				bnum20 = index->blocks[iblock] &
+					 BLOCK_NUMBER_MASK;
+			}
+		}
+
+		bh = sb_bread(sb, bnum20);
+		if (!bh) {
+			brelse(bh_index);
+			return -EIO;
+		}
+		buffer = bh->b_data;
+
+		/* copy to the buffer */
+		if (copy_from_user(buffer + offset, buf, to_write)) {
+			brelse(bh);
+			brelse(bh_index);
+			return -EFAULT;
+		}
+
+		mark_buffer_dirty(bh);
+		brelse(bh);
+
+		/* update block numbers in index block */
+		bno = (bsize12 << 20) | bnum20;
+		index->blocks[iblock] = bno;
+
+		ouichefs_journal_dirty(sb, bh_index);
+
+		brelse(bh_index);
+
+		/* update variables */
+		*ppos += to_write;
+		buf += to_write;
+		len -= to_write;
+		written += to_write;
+
+		/* update size of the file if needed */
+		if (*ppos > inode->i_size) {
+			i_size_write(inode, *ppos);
+			mark_inode_dirty(inode);
+		}
+
+		/* reset offset and get next block */
+		offset = 0;
+		iblock++;
+	}
+
+	return written;
+}
+
+/*
+ * Write the data of from at *ppos without splitting any block, which sends
+ * writes past the end of the data on disk straight into the tail of the file.
+ * Caller must hold wcb_lock.
+ */
+static ssize_t ouichefs_append(struct inode *inode, struct iov_iter *from,
+			       loff_t *ppos)
+{
+	size_t len = iov_iter_count(from);
+	size_t written;
+	int ret;
+
+	ret = ouichefs_commit(inode, *ppos, from);
+	written = len - iov_iter_count(from);
+	if (!written)
+		return ret;
+
+	/* update variables, timestamps are the caller's */
+	*ppos += written;
+	if (*ppos > inode->i_size) {
+		i_size_write(inode, *ppos);
+		mark_inode_dirty(inode);
+	}
+
+	return written;
+}
+
+/*
+ * Writes smaller than the write-combining buffer are staged in memory and
+ * merged into the neighbouring partial blocks when committed. Larger writes
+ * commit the staged data first. They then go straight to the tail when they
+ * start at or past the end of the file, and through the block-splitting path
+ * otherwise.
+ */
+static ssize_t ouichefs_varblock_write(struct file *filep,
+				const char __user *buf,
+				size_t len, loff_t *ppos)
+{
+	struct inode *inode = filep->f_inode;
+	struct ouichefs_inode_info *ii = OUICHEFS_INODE(inode);
+	struct iov_iter from;
+	loff_t start;
+	struct ouichefs_handle handle;
+	ssize_t ret;
+	int retries = 0;
+
+	/* only marks the inode dirty for its timestamps under lazytime */
+	ret = file_update_time(filep);
+	if (ret)
+		return ret;
+
+retry:
+	ouichefs_journal_start(inode->i_sb, &handle);
+	mutex_lock(&ii->wcb_lock);
+	/* adding at the end of the file, which no other write moves now */
+	if (filep->f_flags & O_APPEND)
+		*ppos = i_size_read(inode);
+	start = *ppos;
+
+	/* adding more than max filesize  */
+	if (*ppos + len > OUICHEFS_MAX_FILESIZE) {
+		ret = -EFBIG;
+	} else if (len < OUICHEFS_WCB_SIZE) {
+		ret = ouichefs_stage_write(inode, buf, len, ppos);
+	} else {
+		ret = __ouichefs_flush_wcb(inode);
+		if (!ret && *ppos >= inode->i_size) {
+			iov_iter_ubuf(&from, ITER_SOURCE, (void __user *)buf,
+				      len);
+			ret = ouichefs_append(inode, &from, ppos);
+		} else if (!ret) {
+			ret = ouichefs_split_write(filep, buf, len, ppos);
+		}
+	}
+	mutex_unlock(&ii->wcb_lock);
+	ouichefs_journal_stop(inode->i_sb, &handle);
+	if (*ppos == start &&
+	    ouichefs_journal_retry(inode->i_sb, ret, &retries))
+		goto retry;
+
+	if (ret > 0)
+		ouichefs_varblock_invalidate(inode, start, *ppos);
+
+	return ret;
+}
+
+/*
+ * Writes from an iov_iter, such as the pages of a pipe handed over by splice().
+ * They are committed right away, after the staged writes, and never split a
+ * block.
+ */
+static ssize_t ouichefs_varblock_write_iter(struct kiocb *iocb,
+					    struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ouichefs_inode_info *ii = OUICHEFS_INODE(inode);
+	struct ouichefs_handle handle;
+	size_t count = iov_iter_count(from);
+	loff_t start;
+	ssize_t ret;
+	int retries = 0;
+
+	ret = file_update_time(iocb->ki_filp);
+	if (ret)
+		return ret;
+
+retry:
+	ouichefs_journal_start(inode->i_sb, &handle);
+	mutex_lock(&ii->wcb_lock);
+	if (iocb->ki_flags & IOCB_APPEND)
+		iocb->ki_pos = i_size_read(inode);
+	start = iocb->ki_pos;
+
+	if (iocb->ki_pos + count > OUICHEFS_MAX_FILESIZE)
+		ret = -EFBIG;
+	else
+		ret = __ouichefs_flush_wcb(inode);
+	if (!ret)
+		ret = ouichefs_append(inode, from, &iocb->ki_pos);
+	mutex_unlock(&ii->wcb_lock);
+	ouichefs_journal_stop(inode->i_sb, &handle);
+	if (iocb->ki_pos == start &&
+	    ouichefs_journal_retry(inode->i_sb, ret, &retries)) {
+		iov_iter_revert(from, count - iov_iter_count(from));
+		goto retry;
+	}
+
+	return ret;
+}
+
+/*
+ * Fill a page of the page cache from the variable-size blocks holding its
+ * bytes. Holes and the bytes past the end of file read as zeros. The page gets
+ * no buffer heads, since its bytes are not aligned on the blocks of the file.
+ * The walk of index, NULL for a file without one, starts at the iblock-th
+ * entry, which holds the bytes from *start of the file on. It stops on the
+ * entry holding the first byte of the next page, so that readahead walks the
+ * index once for all its pages.
+ */
+static int ouichefs_varblock_fill(struct inode *inode,
+				  struct ouichefs_file_index_block *index,
+				  struct folio *folio, sector_t *iblock,
+				  loff_t *start)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	uint32_t bnum20, bsize12;
+	loff_t pos = folio_pos(folio), end, from;
+	char *kaddr;
+	int ret = 0;
+
+	end = min_t(loff_t, pos + folio_size(folio), i_size_read(inode));
+	kaddr = kmap_local_folio(folio, 0);
+	memset(kaddr, 0, folio_size(folio));
+
+	for (; index && *iblock < (OUICHEFS_BLOCK_SIZE >> 2) &&
+	       index->blocks[*iblock] != 0 && *start < end;
+	     (*iblock)++) {
+		bsize12 = (index->blocks[*iblock] & BLOCK_SIZE_MASK) >> 20;
+		bnum20 = index->blocks[*iblock] & BLOCK_NUMBER_MASK;
+		if (bnum20 && *start + bsize12 > pos) {
+			bh = sb_bread(sb, bnum20);
+			if (!bh) {
+				ret = -EIO;
+				break;
+			}
+			from = max(pos, *start);
+			memcpy(kaddr + (from - pos),
+			       bh->b_data + (from - *start),
+			       min_t(loff_t, end, *start + bsize12) - from);
+			brelse(bh);
+		}
+		/* the rest of the block is in the next page */
+		if (*start + bsize12 > end)
+			break;
+		*start += bsize12;
+	}
+
+	kunmap_local(kaddr);
+	if (!ret) {
+		flush_dcache_folio(folio);
+		folio_mark_uptodate(folio);
+	}
+
+	return ret;
+}
+
+static int ouichefs_varblock_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	struct ouichefs_file_index_block *index = NULL;
+	struct buffer_head *bh_index = NULL;
+	sector_t iblock = 0;
+	loff_t start = 0;
+	int ret;
+
+	/* Read index block from disk, a file without one is a hole */
+	if (OUICHEFS_INODE(inode)->index_block) {
+		bh_index = sb_bread(inode->i_sb,
+				    OUICHEFS_INODE(inode)->index_block);
+		if (!bh_index) {
+			folio_unlock(folio);
+			return -EIO;
+		}
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	}
+
+	ret = ouichefs_varblock_fill(inode, index, folio, &iblock, &start);
+	brelse(bh_index);
+	folio_unlock(folio);
+
+	return ret;
+}
+
+/*
+ * Called by the page cache to read ahead the pages of a variable-size block
+ * file, sendfile() and splice() among others. The index block is read and
+ * walked once, from page to page.
+ */
+static void ouichefs_varblock_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct ouichefs_file_index_block *index = NULL;
+	struct buffer_head *bh_index = NULL;
+	struct folio *folio;
+	sector_t iblock = 0;
+	loff_t start = 0;
+
+	/* the pages left locked are dropped, and read again by read_folio */
+	if (OUICHEFS_INODE(inode)->index_block) {
+		bh_index = sb_bread(inode->i_sb,
+				    OUICHEFS_INODE(inode)->index_block);
+		if (!bh_index)
+			return;
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	}
+
+	while ((folio = readahead_folio(rac)) != NULL) {
+		ouichefs_varblock_fill(inode, index, folio, &iblock, &start);
+		folio_unlock(folio);
+	}
+
+	brelse(bh_index);
+}
+
+const struct address_space_operations ouichefs_varblock_aops = {
+	.read_folio = ouichefs_varblock_read_folio,
+	.readahead = ouichefs_varblock_readahead,
+};
+
+/*
+ * Reads through the page cache, used by readv() and sendfile(). Staged writes
+ * are committed first, so that the pages filled from disk hold them.
+ */
+static ssize_t ouichefs_varblock_read_iter(struct kiocb *iocb,
+					   struct iov_iter *to)
+{
+	int ret = ouichefs_flush_wcb(file_inode(iocb->ki_filp));
+
+	if (ret)
+		return ret;
+
+	return generic_file_read_iter(iocb, to);
+}
+
+static ssize_t ouichefs_varblock_splice_read(struct file *in, loff_t *ppos,
+					     struct pipe_inode_info *pipe,
+					     size_t len, unsigned int flags)
+{
+	int ret = ouichefs_flush_wcb(file_inode(in));
+
+	if (ret)
+		return ret;
+
+	return filemap_splice_read(in, ppos, pipe, len, flags);
+}
+
+/*
+ * DEFRAG is called in a journal handle and with wcb_lock held, by
+ * ouichefs_varblock_ioctl()
+ */
+static long __ouichefs_varblock_ioctl(struct file *file,
+							unsigned int cmd,
+							unsigned long arg)
+{
+	if (_IOC_TYPE(cmd) != OUICHEFS_IOC_MAGIC) {
+		pr_info("Invalid type\n");
+		return -ENOTTY;
+	}
+
+	struct super_block *sb = file->f_inode->i_sb;
+	struct inode *inode = file->f_inode;
+	struct ouichefs_inode_info *ii = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_index;
+	int used_blocks = 0;
+	int partial_blocks = 0;
+	unsigned long internal_frag = 0;
+	char ret[128];
+	int err;
+
+	/* report the blocks as they are once staged writes are committed */
+	if (cmd == DEFRAG)
+		err = __ouichefs_flush_wcb(inode);
+	else
+		err = ouichefs_flush_wcb(inode);
+	if (err)
+		return err;
+
+	/* index bloc, there is none until the first write */
+	struct ouichefs_file_index_block *index = NULL;
+
+	bh_index = NULL;
+	if (ii->index_block) {
+		bh_index = sb_bread(sb, ii->index_block);
+		if (!bh_index) {
+			pr_err("Failed to read index block\n");
+			return -EIO;
+		}
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	}
+
+	/* calculate blocks information */
+	used_blocks = inode->i_blocks;
+	for (int i = 0; index && i < (OUICHEFS_BLOCK_SIZE >> 2) &&
+			index->blocks[i]; i++) {
+		uint32_t sizeb = ((index->blocks[i] & BLOCK_SIZE_MASK) >> 20);
+
+		/* no block behind this entry */
+		if (!(index->blocks[i] & BLOCK_NUMBER_MASK))
+			continue;
+
+		/* bloc is not full */
+		if (sizeb < OUICHEFS_BLOCK_SIZE - 1) {
+			partial_blocks++;
+			internal_frag += (OUICHEFS_BLOCK_SIZE - sizeb);
+		}
+	}
+	brelse(bh_index);
+
+	switch (cmd) {
+	case USED_BLOCKS:
+		snprintf(ret, sizeof(ret), "%d", used_blocks);
+		if (copy_to_user((char *)arg, ret, sizeof(ret))) {
+			pr_info("ouiche_ioctl: copy_to_user failed\n");
+			return -EFAULT;
+		}
+		return 0;
+	case PARTIAL_BLOCKS:
+		snprintf(ret, sizeof(ret), "%d", partial_blocks);
+		if (copy_to_user((char *)arg, ret, sizeof(ret))) {
+			pr_info("ouiche_ioctl: copy_to_user failed\n");
+			return -EFAULT;
+		}
+			return 0;
+	case INTERNAL_FRAG:
+		snprintf(ret, sizeof(ret), "%lu", internal_frag);
+		if (copy_to_user((char *)arg, ret, sizeof(ret))) {
+			pr_info("ouiche_ioctl: copy_to_user failed\n");
+			return -EFAULT;
+		}
+		return 0;
+	case SPLIT_COUNT:
+		snprintf(ret, sizeof(ret), "%u", ii->nr_splits);
+		if (copy_to_user((char *)arg, ret, sizeof(ret))) {
+			pr_info("ouiche_ioctl: copy_to_user failed\n");
+			return -EFAULT;
+		}
+		return 0;
+	case USED_BLOCKS_INFO:
+		if (!ii->index_block)
+			return 0;
+		bh_index = sb_bread(sb, ii->index_block);
+		if (!bh_index)
+			return -EIO;
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+		for (int i = 0; i < (OUICHEFS_BLOCK_SIZE >> 2) &&
+				index->blocks[i]; i++) {
+			/* get block number and size */
+			uint32_t bn = (index->blocks[i] & BLOCK_NUMBER_MASK);
+			uint32_t size = (index->blocks[i] & BLOCK_SIZE_MASK)
+				>> 20;
+
+			if (bn == 0)
+				continue;
+
+			struct buffer_head *bh = sb_bread(sb, bn);
+
+			pr_info("block number : %d  size : %d\n", bn, size);
+			brelse(bh);
+		}
+		brelse(bh_index);
+		return 0;
+	case DEFRAG:
+		int bno_prec, bno_next;
+		struct buffer_head *bh_prec, *bh_next;
+		char *b_prec, *b_next;
+		size_t to_write, remaining, defrag;
+		uint32_t bnum20_prec, bsize12_prec, bnum20_next, bsize12_next;
+
+		/* index bloc, nothing to defragment without one */
+		if (!ii->index_block)
+			return 0;
+		bh_index = sb_bread(sb, ii->index_block);
+		if (!bh_index)
+			return -EIO;
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+		/* blocks are merged and freed below */
+		ii->tail_valid = false;
+
+		defrag = 0; /* counter of the current contiguous data */
+		int bmax = 0;
+
+		while (bmax < (OUICHEFS_BLOCK_SIZE >> 2) &&
+		       index->blocks[bmax])
+			bmax++;
+
+		for (int i = 0; i < bmax; i++) {
+			/* reached the end of file */
+			if (defrag == inode->i_size) {
+				/* liberate the block that is not used */
+				if (index->blocks[i] & BLOCK_NUMBER_MASK) {
+					inode->i_blocks--;
+					put_block(OUICHEFS_SB(sb),
+					index->blocks[i] & BLOCK_NUMBER_MASK);
+				}
+				index->blocks[i] = 0;
+				ouichefs_journal_dirty(sb, bh_index);
+			}
+
+			/* holes are kept as they are */
+			bno_prec = index->blocks[i];
+			if (!(bno_prec & BLOCK_NUMBER_MASK)) {
+				defrag += (bno_prec & BLOCK_SIZE_MASK) >> 20;
+				continue;
+			}
+
+			/* block is full */
+			if ((bno_prec & BLOCK_SIZE_MASK) == BLOCK_SIZE_MASK) {
+				defrag += OUICHEFS_BLOCK_SIZE - 1;
+				continue;
+			} else {
+				/* block is not full */
+				bsize12_prec = (bno_prec & BLOCK_SIZE_MASK)
+									>> 20;
+				defrag += bsize12_prec;
+			}
+			/* transfer next blocks data into the block */
+			for (int j = i + 1; j < bmax; j++) {
+				/* reach the size of the file */
+				if (defrag == inode->i_size)
+					break;
+
+				/* prepare blocks information */
+				bno_next = index->blocks[j];
+				bnum20_prec = bno_prec & BLOCK_NUMBER_MASK;
+				bsize12_prec = (bno_prec & BLOCK_SIZE_MASK)
+									>> 20;
+				bnum20_next = bno_next & BLOCK_NUMBER_MASK;
+				bsize12_next = (bno_next & BLOCK_SIZE_MASK)
+									>> 20;
+				/* data is not moved across a hole */
+				if (!bnum20_next)
+					break;
+
+				/* block is empty */
+				if (bsize12_next == 0)
+					continue;
+
+				/* get blocks data */
+				bh_prec = sb_bread(sb, bnum20_prec);
+				if (!bh_prec) {
+					brelse(bh_index);
+					return -EIO;
+				}
+				bh_next = sb_bread(sb, bnum20_next);
+				if (!bh_next) {
+					brelse(bh_prec);
+					brelse(bh_index);
+					return -EIO;
+				}
+				b_prec = bh_prec->b_data;
+				b_next = bh_next->b_data;
+
+				/* determine how much to write
+					in the precedent block*/
+				remaining = (OUICHEFS_BLOCK_SIZE - 1)
+					- bsize12_prec;
+				to_write = min_t(size_t, remaining,
+					bsize12_next);
+
+				/* move data for the two blocks */
+				memcpy(b_prec + bsize12_prec, b_next,
+					to_write);
+				mark_buffer_dirty(bh_prec);
+				memcpy(b_next, b_next + to_write,
+					bsize12_next - to_write);
+				mark_buffer_dirty(bh_next);
+
+				/* calculate new size and update blocks */
+				bsize12_prec += to_write;
+				bsize12_next -= to_write;
+				defrag += to_write;
+				bno_prec = bsize12_prec << 20 | bnum20_prec;
+				bno_next = bsize12_next << 20 | bnum20_next;
+				index->blocks[i] = bno_prec;
+				index->blocks[j] = bno_next;
+				ouichefs_journal_dirty(sb, bh_index);
+				brelse(bh_prec);
+				brelse(bh_next);
+			}
+		}
+		brelse(bh_index);
+		return 0;
+	default:
+		return ouichefs_engine_ioctl(file, cmd, arg);
+	}
+
+	return 0;
+}
+
+/*
+ * DEFRAG moves data between blocks and rewrites the index, in a journal handle
+ * and under wcb_lock, so that no commit of staged writes caches the tail of the
+ * index meanwhile. The other ioctls take neither: the engine ones lock the
+ * inode, which comes before both.
+ */
+static long ouichefs_varblock_ioctl(struct file *file, unsigned int cmd,
+				    unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_inode_info *ii = OUICHEFS_INODE(inode);
+	struct ouichefs_handle handle;
+	long ret;
+
+	if (cmd != DEFRAG)
+		return __ouichefs_varblock_ioctl(file, cmd, arg);
+
+	ouichefs_journal_start(inode->i_sb, &handle);
+	mutex_lock(&ii->wcb_lock);
+	ret = __ouichefs_varblock_ioctl(file, cmd, arg);
+	mutex_unlock(&ii->wcb_lock);
+	ouichefs_journal_stop(inode->i_sb, &handle);
+
+	return ret;
+}
+
+const struct file_operations ouichefs_varblock_file_ops = {
+	.owner = THIS_MODULE,
+	.open = ouichefs_file_open,
+	.release = ouichefs_varblock_release,
+	.llseek = ouichefs_llseek,
+	.fallocate = ouichefs_fallocate,
+	.read = ouichefs_varblock_read,
+	.read_iter = ouichefs_varblock_read_iter,
+	.write = ouichefs_varblock_write,
+	.write_iter = ouichefs_varblock_write_iter,
+	.splice_read = ouichefs_varblock_splice_read,
+	.splice_write = iter_file_splice_write,
+	.fsync = ouichefs_varblock_fsync,
+	.unlocked_ioctl = ouichefs_varblock_ioctl
+};
@@ -13,24 +13,6 @@
 
 #include "ouichefs.h"
 
-/*
- * Mount a ouiche_fs partition
- */
-struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
-			      const char *dev_name, void *data)
-{
-	struct dentry *dentry = NULL;
-
-	dentry =
-		mount_bdev(fs_type, flags, dev_name, data, ouichefs_fill_super);
-	if (IS_ERR(dentry))
-		pr_err("'%s' mount failure\n", dev_name);
-	else
-		pr_info("'%s' mount success\n", dev_name);
-
-	return dentry;
-}
-
 /*
  * Unmount a ouiche_fs partition
  */
@@ -44,7 +26,8 @@ void ouichefs_kill_sb(struct super_block *sb)
 static struct file_system_type ouichefs_file_system_type = {
 	.owner = THIS_MODULE,
 	.name = "ouichefs",
-	.mount = ouichefs_mount,
+	.init_fs_context = ouichefs_init_fs_context,
+	.parameters = ouichefs_fs_parameters,
 	.kill_sb = ouichefs_kill_sb,
 	.fs_flags = FS_REQUIRES_DEV,
 	.next = NULL,
@@ -60,15 +43,23 @@ static int __init ouichefs_init(void)
 		goto err;
 	}
 
+	ret = ouichefs_init_dir_cache();
+	if (ret) {
+		pr_err("directory cache shrinker registration failed\n");
+		goto err_inode;
+	}
+
 	ret = register_filesystem(&ouichefs_file_system_type);
 	if (ret) {
 		pr_err("register_filesystem() failed\n");
-		goto err_inode;
+		goto err_dir;
 	}
 
 	pr_info("module loaded\n");
 	return 0;
 
+err_dir:
+	ouichefs_destroy_dir_cache();
 err_inode:
 	ouichefs_destroy_inode_cache();
 err:
@@ -83,6 +74,7 @@ static void __exit ouichefs_exit(void)
 	if (ret)
 		pr_err("unregister_filesystem() failed\n");
 
+	ouichefs_destroy_dir_cache();
 	ouichefs_destroy_inode_cache();
 
 	pr_info("module unloaded\n");
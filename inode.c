@@ -11,6 +11,7 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/random.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
@@ -57,27 +58,29 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	inode->i_sb = sb;
 	inode->i_op = &ouichefs_inode_ops;
 
-	inode->i_mode = le32_to_cpu(cinode->i_mode);
+	inode->i_mode = le16_to_cpu(cinode->i_mode);
 	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
 	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
 	inode->i_size = le32_to_cpu(cinode->i_size);
-	inode->i_ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
-	inode->i_ctime.tv_nsec = (long)le64_to_cpu(cinode->i_nctime);
-	inode->i_atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
-	inode->i_atime.tv_nsec = (long)le64_to_cpu(cinode->i_natime);
-	inode->i_mtime.tv_sec = (time64_t)le32_to_cpu(cinode->i_mtime);
-	inode->i_mtime.tv_nsec = (long)le64_to_cpu(cinode->i_nmtime);
+	inode->i_ctime.tv_sec = (time64_t)le64_to_cpu(cinode->i_ctime);
+	inode->i_ctime.tv_nsec = le32_to_cpu(cinode->i_nctime) &
+				 OUICHEFS_NSEC_MASK;
+	inode->i_atime.tv_sec = (time64_t)le64_to_cpu(cinode->i_atime);
+	inode->i_atime.tv_nsec = le32_to_cpu(cinode->i_natime) &
+				 OUICHEFS_NSEC_MASK;
+	inode->i_mtime.tv_sec = (time64_t)le64_to_cpu(cinode->i_mtime);
+	inode->i_mtime.tv_nsec = le32_to_cpu(cinode->i_nmtime) &
+				 OUICHEFS_NSEC_MASK;
 	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->i_flags = le16_to_cpu(cinode->i_flags);
 
-	if (S_ISDIR(inode->i_mode)) {
+	if (S_ISDIR(inode->i_mode))
 		inode->i_fop = &ouichefs_dir_ops;
-	} else if (S_ISREG(inode->i_mode)) {
-		inode->i_fop = &ouichefs_file_ops;
-		inode->i_mapping->a_ops = &ouichefs_aops;
-	}
+	else if (S_ISREG(inode->i_mode))
+		ouichefs_set_file_ops(inode);
 
 	brelse(bh);
 
@@ -101,39 +104,26 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 				      unsigned int flags)
 {
 	struct super_block *sb = dir->i_sb;
-	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
 	struct inode *inode = NULL;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
+	uint32_t ino;
+	int ret;
 
 	/* Check filename length */
 	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return ERR_PTR(-EIO);
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
 	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!strncmp(f->filename, dentry->d_name.name,
-			     OUICHEFS_FILENAME_LEN)) {
-			inode = ouichefs_iget(sb, f->inode);
-			break;
-		}
-	}
-	brelse(bh);
+	ret = ouichefs_dir_lookup(dir, &dentry->d_name, &ino);
+	if (ret == -EIO)
+		return ERR_PTR(ret);
+	if (!ret)
+		inode = ouichefs_iget(sb, ino);
 
-	/* Update directory access time */
-	dir->i_atime = current_time(dir);
-	mark_inode_dirty(dir);
+	/*
+	 * The access time of dir is left alone: it is updated when it is
+	 * read by readdir, through file_accessed(), which honours noatime,
+	 * relatime and lazytime.
+	 */
 
 	/* Fill the dentry with the inode */
 	d_add(dentry, inode);
@@ -141,6 +131,40 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 	return NULL;
 }
 
+/* Inodes among which top-level directories are spread, see below */
+#define OUICHEFS_INODE_GROUP 1024
+
+/*
+ * Inode number from which to look for the inode of a new file in dir, in the
+ * way of the Orlov allocator of ext2. Files and subdirectories go right after
+ * their parent, so that a subtree fills a few inode store blocks. Top-level
+ * directories start new subtrees: they go to the first group of inodes, from a
+ * random one, with at least the average number of free inodes.
+ */
+static uint32_t ouichefs_inode_goal(struct inode *dir, umode_t mode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	uint32_t nr_groups, avg, start, first, len, nr_free, i;
+
+	if (!S_ISDIR(mode) || dir != d_inode(dir->i_sb->s_root))
+		return dir->i_ino;
+
+	nr_groups = DIV_ROUND_UP(sbi->nr_inodes, OUICHEFS_INODE_GROUP);
+	avg = sbi->nr_free_inodes / nr_groups;
+	start = get_random_u32_below(nr_groups);
+	for (i = 0; i < nr_groups; i++) {
+		first = ((start + i) % nr_groups) * OUICHEFS_INODE_GROUP;
+		len = min_t(uint32_t, OUICHEFS_INODE_GROUP,
+			    sbi->nr_inodes - first);
+		nr_free = bitmap_weight(sbi->ifree_bitmap +
+					first / BITS_PER_LONG, len);
+		if (nr_free && nr_free >= avg)
+			return first;
+	}
+
+	return dir->i_ino;
+}
+
 /*
  * Create a new inode in dir.
  */
@@ -150,7 +174,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	struct ouichefs_inode_info *ci;
 	struct super_block *sb;
 	struct ouichefs_sb_info *sbi;
-	uint32_t ino, bno;
+	uint32_t ino;
 	int ret;
 
 	/* Check mode before doing anything to avoid undoing everything */
@@ -166,7 +190,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
-	ino = get_free_inode(sbi);
+	ino = get_free_inode(sbi, ouichefs_inode_goal(dir, mode));
 	if (!ino)
 		return ERR_PTR(-ENOSPC);
 	inode = ouichefs_iget(sb, ino);
@@ -176,25 +200,25 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	}
 	ci = OUICHEFS_INODE(inode);
 
-	/* Get a free block for this new inode's index */
-	bno = get_free_block(sbi);
-	if (!bno) {
-		ret = -ENOSPC;
-		goto put_inode;
-	}
-	ci->index_block = bno;
-
-	/* Initialize inode */
+	/*
+	 * Initialize inode. A directory gets its index block right away, a
+	 * regular file only with its first block.
+	 */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
-	inode->i_blocks = 1;
+	inode->i_blocks = 0;
+	ci->index_block = 0;
 	if (S_ISDIR(mode)) {
+		ret = ouichefs_alloc_index(inode);
+		if (ret)
+			goto put_inode;
 		inode->i_size = OUICHEFS_BLOCK_SIZE;
 		inode->i_fop = &ouichefs_dir_ops;
 		set_nlink(inode, 2); /* . and .. */
 	} else if (S_ISREG(mode)) {
 		inode->i_size = 0;
-		inode->i_fop = &ouichefs_file_ops;
-		inode->i_mapping->a_ops = &ouichefs_aops;
+		/* Record the engine so the file keeps it across mounts */
+		ci->i_flags = sbi->engine;
+		ouichefs_set_file_ops(inode);
 		set_nlink(inode, 1);
 	}
 
@@ -212,89 +236,58 @@ put_ino:
 
 /*
  * Create a file or directory in this way:
- *   - check filename length and if the parent directory is not full
+ *   - check filename length
  *   - create the new inode (allocate inode and blocks)
- *   - cleanup index block of the new inode
- *   - add new file/directory in parent index
+ *   - add new file/directory in parent index, undoing all if it is full
  */
 static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 			   struct dentry *dentry, umode_t mode, bool excl)
 {
 	struct super_block *sb;
 	struct inode *inode;
-	struct ouichefs_inode_info *ci_dir;
-	struct ouichefs_dir_block *dblock;
-	char *fblock;
-	struct buffer_head *bh, *bh2;
-	int ret = 0, i;
+	struct ouichefs_handle handle;
+	int ret, retries = 0;
 
 	/* Check filename length */
-	if (strlen(dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
+	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Read parent directory index */
-	ci_dir = OUICHEFS_INODE(dir);
-	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		ret = -EMLINK;
-		goto end;
-	}
-
 	/* Get a new free inode */
+	sb = dir->i_sb;
+retry:
+	ret = 0;
+	ouichefs_journal_start(sb, &handle);
 	inode = ouichefs_new_inode(dir, mode);
 	if (IS_ERR(inode)) {
 		ret = PTR_ERR(inode);
-		goto end;
+		goto stop;
 	}
 
-	/*
-	 * Scrub index_block for new file/directory to avoid previous data
-	 * messing with new file/directory.
-	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh2) {
-		ret = -EIO;
+	/* Register new inode in parent index, fails if it is full */
+	ret = ouichefs_dir_add(dir, &dentry->d_name, inode);
+	if (ret)
 		goto iput;
-	}
-	fblock = (char *)bh2->b_data;
-	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
-	brelse(bh2);
-
-	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
-		if (dblock->files[i].inode == 0)
-			break;
-	dblock->files[i].inode = inode->i_ino;
-	strscpy(dblock->files[i].filename, dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
-	brelse(bh);
 
 	/* Update stats and mark dir and new inode dirty */
 	mark_inode_dirty(inode);
-	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
 	if (S_ISDIR(mode))
 		inode_inc_link_count(dir);
 	mark_inode_dirty(dir);
 
 	/* setup dentry */
 	d_instantiate(dentry, inode);
-
-	return 0;
+	goto stop;
 
 iput:
-	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
+	if (OUICHEFS_INODE(inode)->index_block)
+		put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
 	put_inode(OUICHEFS_SB(sb), inode->i_ino);
 	iput(inode);
-end:
-	brelse(bh);
+stop:
+	ouichefs_journal_stop(sb, &handle);
+	if (ouichefs_journal_retry(sb, ret, &retries))
+		goto retry;
 	return ret;
 }
 
@@ -310,82 +303,75 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	struct super_block *sb = dir->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
+	struct buffer_head *bh = NULL;
 	struct ouichefs_file_index_block *file_block = NULL;
-	uint32_t ino, bno;
-	int i, f_id = -1, nr_subs = 0;
+	uint32_t ino, bno, mask;
+	struct ouichefs_handle handle;
+	int i, ret;
 
 	ino = inode->i_ino;
 	bno = OUICHEFS_INODE(inode)->index_block;
 
-	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
-	if (!bh)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
 	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	ouichefs_journal_start(sb, &handle);
+	ret = ouichefs_dir_remove(dir, &dentry->d_name);
+	if (ret)
+		goto stop;
 
 	/* Update inode stats */
-	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
 	if (S_ISDIR(inode->i_mode))
 		inode_dec_link_count(dir);
 	mark_inode_dirty(dir);
 
+	/* staged writes must not be committed to freed blocks */
+	mutex_lock(&OUICHEFS_INODE(inode)->wcb_lock);
+	if (OUICHEFS_INODE(inode)->wcb)
+		OUICHEFS_INODE(inode)->wcb->len = 0;
+	mutex_unlock(&OUICHEFS_INODE(inode)->wcb_lock);
+
 	/*
 	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
 	 * index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block, don't fail (too late
-	 * anyway), just put the block and continue.
+	 * forever. A file without index block has no block at all. Freed data
+	 * blocks are not scrubbed: they must keep their data until the unlink
+	 * is committed, and the commit that maps them to another file writes
+	 * its new data first.
 	 */
+	if (!bno)
+		goto clean_inode;
 	bh = sb_bread(sb, bno);
 	if (!bh)
 		goto clean_inode;
 	file_block = (struct ouichefs_file_index_block *)bh->b_data;
-	if (S_ISDIR(inode->i_mode))
+	if (S_ISDIR(inode->i_mode)) {
+		ouichefs_dir_put_blocks(inode);
 		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
+	}
 
-		if (!file_block->blocks[i])
-			continue;
+	mask = ouichefs_entry_mask(inode);
+	for (i = 0; i < (OUICHEFS_BLOCK_SIZE >> 2); i++) {
+		uint32_t bn = file_block->blocks[i] & mask;
 
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
+		/* OUICHEFS_COMPR_ADDR only marks a compressed cluster */
+		if (!bn || bn == OUICHEFS_COMPR_ADDR)
 			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
+
+		/* a block shared with a clone only loses a reference */
+		put_block(sbi, bn);
 	}
 
 scrub:
 	/* Scrub index block */
 	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(sb, bh);
 	brelse(bh);
 
 clean_inode:
 	/* Cleanup inode and mark dirty */
 	inode->i_blocks = 0;
 	OUICHEFS_INODE(inode)->index_block = 0;
+	OUICHEFS_INODE(inode)->i_flags = 0;
 	inode->i_size = 0;
 	i_uid_write(inode, 0);
 	i_gid_write(inode, 0);
@@ -398,116 +384,75 @@ clean_inode:
 	mark_inode_dirty(inode);
 
 	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
+	if (bno)
+		put_block(sbi, bno);
 	put_inode(sbi, ino);
 
-	return 0;
+stop:
+	ouichefs_journal_stop(sb, &handle);
+	return ret;
 }
 
 static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 			   struct dentry *old_dentry, struct inode *new_dir,
 			   struct dentry *new_dentry, unsigned int flags)
 {
-	struct super_block *sb = old_dir->i_sb;
-	struct ouichefs_inode_info *ci_old = OUICHEFS_INODE(old_dir);
-	struct ouichefs_inode_info *ci_new = OUICHEFS_INODE(new_dir);
 	struct inode *src = d_inode(old_dentry);
-	struct buffer_head *bh_old = NULL, *bh_new = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
+	struct ouichefs_handle handle;
+	int ret;
 
 	/* fail with these unsupported flags */
 	if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
 		return -EINVAL;
 
 	/* Check if filename is not too long */
-	if (strlen(new_dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
+	if (new_dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
-	if (!bh_new)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		/* if old_dir == new_dir, save the renamed file position */
-		if (new_dir == old_dir) {
-			if (strncmp(dir_block->files[i].filename,
-				    old_dentry->d_name.name,
-				    OUICHEFS_FILENAME_LEN) == 0)
-				f_pos = i;
-		}
-		if (strncmp(dir_block->files[i].filename,
-			    new_dentry->d_name.name,
-			    OUICHEFS_FILENAME_LEN) == 0) {
-			ret = -EEXIST;
-			goto relse_new;
-		}
-		if (new_pos < 0 && dir_block->files[i].inode == 0)
-			new_pos = i;
-	}
-	/* if old_dir == new_dir, just rename entry */
-	if (old_dir == new_dir) {
-		strscpy(dir_block->files[f_pos].filename,
-			new_dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
-		goto relse_new;
-	}
+	ouichefs_journal_start(old_dir->i_sb, &handle);
 
-	/* If new directory is empty, fail */
-	if (new_pos < 0) {
-		ret = -EMLINK;
-		goto relse_new;
+	/*
+	 * In the same directory, free the old entry first so that the new one
+	 * finds room, and put it back if the new name is taken.
+	 */
+	if (old_dir == new_dir) {
+		ret = ouichefs_dir_remove(old_dir, &old_dentry->d_name);
+		if (ret)
+			goto stop;
+		ret = ouichefs_dir_add(new_dir, &new_dentry->d_name, src);
+		if (ret) {
+			ouichefs_dir_add(old_dir, &old_dentry->d_name, src);
+			goto stop;
+		}
+		old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
+		mark_inode_dirty(old_dir);
+		goto stop;
 	}
 
-	/* insert in new parent directory */
-	dir_block->files[new_pos].inode = src->i_ino;
-	strscpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
-	brelse(bh_new);
+	/* Insert in new parent, fails if new_dentry exists or if it is full */
+	ret = ouichefs_dir_add(new_dir, &new_dentry->d_name, src);
+	if (ret)
+		goto stop;
 
 	/* Update new parent inode metadata */
-	new_dir->i_atime = new_dir->i_ctime = new_dir->i_mtime =
-		current_time(new_dir);
+	new_dir->i_ctime = new_dir->i_mtime = current_time(new_dir);
 	if (S_ISDIR(src->i_mode))
 		inode_inc_link_count(new_dir);
 	mark_inode_dirty(new_dir);
 
 	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
-	if (!bh_old)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
-	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == src->i_ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
-	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
-	brelse(bh_old);
+	ret = ouichefs_dir_remove(old_dir, &old_dentry->d_name);
+	if (ret)
+		goto stop;
 
 	/* Update old parent inode metadata */
-	old_dir->i_atime = old_dir->i_ctime = old_dir->i_mtime =
-		current_time(old_dir);
+	old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
 	if (S_ISDIR(src->i_mode))
 		inode_dec_link_count(old_dir);
 	mark_inode_dirty(old_dir);
 
-	return 0;
-
-relse_new:
-	brelse(bh_new);
+stop:
+	ouichefs_journal_stop(old_dir->i_sb, &handle);
 	return ret;
 }
 
@@ -519,28 +464,54 @@ static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 
 static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct super_block *sb = dir->i_sb;
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh;
-	struct ouichefs_dir_block *dblock;
+	int ret;
 
 	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-	if (dblock->files[0].inode != 0) {
-		brelse(bh);
+	ret = ouichefs_dir_is_empty(inode);
+	if (ret < 0)
+		return ret;
+	if (!ret)
 		return -ENOTEMPTY;
-	}
-	brelse(bh);
 
 	/* Remove directory with unlink */
 	return ouichefs_unlink(dir, dentry);
 }
 
+/*
+ * Change the attributes of the inode. A size change goes through the I/O engine
+ * of the file, which frees the blocks past the new end of file. This is also
+ * how open(O_TRUNC) reaches us.
+ */
+static int ouichefs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+			    struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ouichefs_handle handle;
+	int ret;
+
+	ret = setattr_prepare(idmap, dentry, iattr);
+	if (ret)
+		return ret;
+
+	ouichefs_journal_start(inode->i_sb, &handle);
+	if ((iattr->ia_valid & ATTR_SIZE) && iattr->ia_size != inode->i_size) {
+		ret = ouichefs_truncate(inode, iattr->ia_size);
+		if (ret)
+			goto stop;
+		inode->i_mtime = inode->i_ctime = current_time(inode);
+	}
+
+	setattr_copy(idmap, inode, iattr);
+	mark_inode_dirty(inode);
+
+stop:
+	ouichefs_journal_stop(inode->i_sb, &handle);
+	return ret;
+}
+
 static const struct inode_operations ouichefs_inode_ops = {
 	.lookup = ouichefs_lookup,
 	.create = ouichefs_create,
@@ -548,4 +519,5 @@ static const struct inode_operations ouichefs_inode_ops = {
 	.mkdir = ouichefs_mkdir,
 	.rmdir = ouichefs_rmdir,
 	.rename = ouichefs_rename,
+	.setattr = ouichefs_setattr,
 };
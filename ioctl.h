@@ -7,5 +7,21 @@
 #define INTERNAL_FRAG _IOR(OUICHEFS_IOC_MAGIC, 3, int)
 #define USED_BLOCKS_INFO _IOR(OUICHEFS_IOC_MAGIC, 4, int)
 #define DEFRAG _IOR(OUICHEFS_IOC_MAGIC, 5, int)
+#define SPLIT_COUNT _IOR(OUICHEFS_IOC_MAGIC, 6, int)
+#define GET_ENGINE _IOR(OUICHEFS_IOC_MAGIC, 7, int)
+#define SET_ENGINE _IOW(OUICHEFS_IOC_MAGIC, 8, int)
+#define GET_COMPRESS _IOR(OUICHEFS_IOC_MAGIC, 9, int)
+#define SET_COMPRESS _IOW(OUICHEFS_IOC_MAGIC, 10, int)
+
+/* I/O engines owning the data of a regular file */
+#define OUICHEFS_ENGINE_DEFAULT 0 /* Engine selected at mount time */
+#define OUICHEFS_ENGINE_PAGECACHE 1 /* Page cache over 4 KiB blocks */
+#define OUICHEFS_ENGINE_DIRECT 2 /* Direct read/write of 4 KiB blocks */
+#define OUICHEFS_ENGINE_VARBLOCK 3 /* Direct read/write of variable-size blocks */
+
+/* Algorithms compressing the data of a page-cache file */
+#define OUICHEFS_COMPRESS_NONE 0
+#define OUICHEFS_COMPRESS_LZ4 1
+#define OUICHEFS_COMPRESS_ZSTD 2
 
 #endif
@@ -0,0 +1,693 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+
+#include "ouichefs.h"
+
+/*
+ * Metadata journal
+ *
+ * The metadata blocks (superblock, bitmaps, inode store, index and directory
+ * blocks) are not written in place as they change. They join the running
+ * transaction instead, and stay in memory until it is committed:
+ *   1. the data is written first, so that the committed metadata never points
+ *      to stale data: the page cache of the files given new blocks by the
+ *      transaction and the staged writes of variable-size block files, then
+ *      the data written through the buffer cache,
+ *   2. a copy of every block of the transaction is written to the journal, then
+ *      its header, with their home block numbers and a checksum,
+ *   3. the blocks are written in place (checkpoint).
+ * A crash leaves the metadata of either the previous or the new transaction on
+ * disk, and the next mount replays the last one that was committed.
+ *
+ * Commits are grouped: all the operations in between make one transaction,
+ * committed every commit_interval seconds, on fsync() and sync(), and when it
+ * fills a quarter of the journal.
+ *
+ * Operations changing metadata run in a handle, so that no commit catches them
+ * half done. Handles nest, and are taken before the wcb, page and buffer locks.
+ * A handle is given OUICHEFS_JOURNAL_CREDITS blocks of the journal, and is only
+ * started once the transaction has room for them on top of what it holds, of
+ * the bitmap blocks it changes and of the credits of the other handles. The
+ * few operations that may change more blocks reserve them on their own.
+ */
+
+/* The buffer is in the running transaction */
+enum { BH_Journaled = BH_PrivateStart };
+BUFFER_FNS(Journaled, journaled)
+TAS_BUFFER_FNS(Journaled, journaled)
+
+/* Blocks the commit of the staged writes of a file may add to it */
+#define OUICHEFS_JOURNAL_WCB_CREDITS 6
+
+/*
+ * Credits the running transaction can still give, once the superblock and the
+ * bitmap blocks it changes are logged. Called with j_lock held.
+ */
+static uint32_t ouichefs_journal_room(struct ouichefs_sb_info *sbi)
+{
+	uint32_t used = sbi->j_nr + READ_ONCE(sbi->j_map_nr) + 1 +
+			sbi->j_reserved + sbi->j_extra;
+
+	return used < sbi->j_max ? sbi->j_max - used : 0;
+}
+
+/*
+ * Start a handle, committing the running transaction first if it grew large or
+ * has no room left for the credits of the handle.
+ * A handle nested in a handle of the same task does nothing, and is marked as
+ * not started for ouichefs_journal_stop(). Allocations made in a handle do not
+ * recurse into filesystems: reclaim could evict one of our inodes and wait for
+ * the commit the handle holds back.
+ */
+void ouichefs_journal_start(struct super_block *sb,
+			    struct ouichefs_handle *handle)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	handle->started = current->journal_info != sbi;
+	if (!handle->started)
+		return;
+
+	/* the blocks a transaction frees are only reusable once committed */
+	if (READ_ONCE(sbi->j_nr) > sbi->j_max / 4 ||
+	    sbi->nr_pending_blocks > sbi->nr_free_blocks)
+		ouichefs_journal_commit(sb);
+
+	spin_lock(&sbi->j_lock);
+	while (ouichefs_journal_room(sbi) < OUICHEFS_JOURNAL_CREDITS &&
+	       !sb_rdonly(sb)) {
+		spin_unlock(&sbi->j_lock);
+		ouichefs_journal_commit(sb);
+		spin_lock(&sbi->j_lock);
+	}
+	sbi->j_reserved += OUICHEFS_JOURNAL_CREDITS;
+	spin_unlock(&sbi->j_lock);
+
+	down_read(&sbi->j_sem);
+	handle->nofs = memalloc_nofs_save();
+	/* never clobber the handle of another filesystem we were called in */
+	if (!current->journal_info)
+		current->journal_info = sbi;
+}
+
+void ouichefs_journal_stop(struct super_block *sb,
+			   struct ouichefs_handle *handle)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!handle->started)
+		return;
+
+	if (current->journal_info == sbi)
+		current->journal_info = NULL;
+	memalloc_nofs_restore(handle->nofs);
+	spin_lock(&sbi->j_lock);
+	sbi->j_reserved -= OUICHEFS_JOURNAL_CREDITS;
+	spin_unlock(&sbi->j_lock);
+	up_read(&sbi->j_sem);
+}
+
+/*
+ * Reserve nr more blocks of the running transaction, until its commit, for an
+ * operation that may change more than the credits of its handle. Return
+ * -ENOSPC if it has no room for them: the operation can be retried once it is
+ * committed, see ouichefs_journal_retry().
+ */
+int ouichefs_journal_extend(struct super_block *sb, uint32_t nr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret = 0;
+
+	spin_lock(&sbi->j_lock);
+	if (ouichefs_journal_room(sbi) >= nr)
+		sbi->j_extra += nr;
+	else
+		ret = -ENOSPC;
+	spin_unlock(&sbi->j_lock);
+
+	return ret;
+}
+
+/*
+ * Add the metadata buffer bh to the running transaction, in place of
+ * mark_buffer_dirty(). It stays in memory until the commit, which logs all the
+ * changes made to it until then. Callers hold a handle, or are the commit.
+ */
+void ouichefs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	bool full = false;
+
+	/* only the checkpoint writes it in place */
+	clear_buffer_dirty(bh);
+
+	spin_lock(&sbi->j_lock);
+	if (!test_set_buffer_journaled(bh)) {
+		if (sbi->j_nr < sbi->j_max) {
+			get_bh(bh);
+			sbi->j_bhs[sbi->j_nr++] = bh;
+		} else {
+			clear_buffer_journaled(bh);
+			full = true;
+		}
+	}
+	spin_unlock(&sbi->j_lock);
+
+	/* the credits of the handles leave room for all their blocks */
+	if (WARN_ON_ONCE(full)) {
+		pr_err_ratelimited("journal full, block %llu written in place\n",
+				   (unsigned long long)bh->b_blocknr);
+		mark_buffer_dirty(bh);
+	}
+}
+
+/*
+ * Have the next commit write the data of inode first: the transaction maps new
+ * blocks of a page-cache file whose data is only in memory yet, or logs the
+ * size of a variable-size block file that has staged writes. Committing these
+ * changes metadata too, the journal keeps room for it.
+ */
+void ouichefs_journal_add_inode(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	spin_lock(&sbi->j_lock);
+	if (list_empty(&ci->j_list)) {
+		list_add_tail(&ci->j_list, &sbi->j_inodes);
+		if (ouichefs_file_engine(inode) == OUICHEFS_ENGINE_VARBLOCK)
+			sbi->j_extra += OUICHEFS_JOURNAL_WCB_CREDITS;
+	}
+	spin_unlock(&sbi->j_lock);
+}
+
+/* Take inode off the list of the commit before it is freed */
+void ouichefs_journal_forget_inode(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	spin_lock(&sbi->j_lock);
+	list_del_init(&ci->j_list);
+	spin_unlock(&sbi->j_lock);
+}
+
+/*
+ * Write back and wait for the page cache of the files given new blocks by the
+ * transaction, and commit the staged writes of variable-size block files. An
+ * inode being evicted is skipped: it is either clean already or deleted. This
+ * may still change the transaction, which is not closed.
+ */
+static int ouichefs_journal_ordered(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci;
+	struct inode *inode;
+	int ret = 0, err;
+
+	spin_lock(&sbi->j_lock);
+	while (!list_empty(&sbi->j_inodes)) {
+		ci = list_first_entry(&sbi->j_inodes,
+				      struct ouichefs_inode_info, j_list);
+		list_del_init(&ci->j_list);
+		inode = igrab(&ci->vfs_inode);
+		spin_unlock(&sbi->j_lock);
+		if (inode) {
+			if (ouichefs_file_engine(inode) ==
+			    OUICHEFS_ENGINE_VARBLOCK)
+				err = ouichefs_flush_wcb(inode);
+			else
+				err = filemap_write_and_wait(inode->i_mapping);
+			if (err && !ret)
+				ret = err;
+			iput(inode);
+		}
+		spin_lock(&sbi->j_lock);
+	}
+	spin_unlock(&sbi->j_lock);
+
+	return ret;
+}
+
+/* Write the locked buffer bh, whether it is dirty or not */
+static void ouichefs_journal_submit(struct buffer_head *bh, blk_opf_t flags)
+{
+	clear_buffer_dirty(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	submit_bh(REQ_OP_WRITE | flags, bh);
+}
+
+/* Wait for the writes of the nr buffers bhs and release them */
+static int ouichefs_journal_wait(struct buffer_head **bhs, uint32_t nr)
+{
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			ret = -EIO;
+		put_bh(bhs[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * Add the blocks of a bitmap kept in memory, stored in the nr blocks from
+ * block first, that changed since the last commit to the transaction.
+ */
+static int ouichefs_journal_bitmap(struct super_block *sb, uint32_t first,
+				   void *map, uint32_t nr)
+{
+	struct buffer_head *bh;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		bh = sb_bread(sb, first + i);
+		if (!bh)
+			return -EIO;
+		if (memcmp(bh->b_data, map + i * OUICHEFS_BLOCK_SIZE,
+			   OUICHEFS_BLOCK_SIZE)) {
+			memcpy(bh->b_data, map + i * OUICHEFS_BLOCK_SIZE,
+			       OUICHEFS_BLOCK_SIZE);
+			ouichefs_journal_dirty(sb, bh);
+		}
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+/*
+ * Add the metadata kept in memory (superblock counters and bitmaps) to the
+ * transaction. The blocks freed by the transaction become free with it.
+ */
+static int ouichefs_journal_sb_info(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_sb_info *disk_sb;
+	struct buffer_head *bh;
+	uint32_t first = sbi->nr_istore_blocks + 1;
+	int ret;
+
+	spin_lock(&sbi->bitmap_lock);
+	if (sbi->nr_pending_blocks) {
+		bitmap_or(sbi->bfree_bitmap, sbi->bfree_bitmap,
+			  sbi->bfree_pending, sbi->nr_blocks);
+		bitmap_zero(sbi->bfree_pending, sbi->nr_blocks);
+		sbi->nr_free_blocks += sbi->nr_pending_blocks;
+		sbi->nr_pending_blocks = 0;
+	}
+	/* the blocks of j_map are logged below, no handle can change them */
+	bitmap_zero(sbi->j_map, sbi->j_first - first);
+	WRITE_ONCE(sbi->j_map_nr, 0);
+	spin_unlock(&sbi->bitmap_lock);
+
+	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return -EIO;
+	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
+	if (disk_sb->nr_free_inodes != sbi->nr_free_inodes ||
+	    disk_sb->nr_free_blocks != sbi->nr_free_blocks) {
+		disk_sb->nr_free_inodes = sbi->nr_free_inodes;
+		disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+		ouichefs_journal_dirty(sb, bh);
+	}
+	brelse(bh);
+
+	ret = ouichefs_journal_bitmap(sb, first, sbi->ifree_bitmap,
+				      sbi->nr_ifree_blocks);
+	if (ret)
+		return ret;
+	first += sbi->nr_ifree_blocks;
+	ret = ouichefs_journal_bitmap(sb, first, sbi->bfree_bitmap,
+				      sbi->nr_bfree_blocks);
+	if (ret)
+		return ret;
+	first += sbi->nr_bfree_blocks;
+
+	return ouichefs_journal_bitmap(sb, first, sbi->bref_map,
+				       sbi->nr_bref_blocks);
+}
+
+/*
+ * Write the journal header for the transaction seq of nr blocks, whose home
+ * block numbers are taken from j_commit. The cache of the device is flushed
+ * before, so that the blocks it describes are on disk first, and the header
+ * itself is written through (FUA).
+ */
+static int ouichefs_journal_header(struct super_block *sb, uint32_t seq,
+				   uint32_t nr, uint32_t checksum)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal_header *header;
+	struct buffer_head *bh;
+	uint32_t i;
+
+	bh = sb_getblk(sb, sbi->j_first);
+	if (!bh)
+		return -ENOMEM;
+	lock_buffer(bh);
+	header = (struct ouichefs_journal_header *)bh->b_data;
+	memset(header, 0, OUICHEFS_BLOCK_SIZE);
+	header->magic = OUICHEFS_JOURNAL_MAGIC;
+	header->seq = seq;
+	header->nr_blocks = nr;
+	header->checksum = checksum;
+	for (i = 0; i < nr; i++)
+		header->blocks[i] = sbi->j_commit[i]->b_blocknr;
+	set_buffer_uptodate(bh);
+	ouichefs_journal_submit(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+
+	return ouichefs_journal_wait(&bh, 1);
+}
+
+/* Write the nr blocks of j_commit and their header to the journal */
+static int ouichefs_journal_log(struct super_block *sb, uint32_t nr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh, *jbh;
+	uint32_t i, crc, seq = sbi->j_seq + 1;
+	int ret;
+
+	crc = seq;
+	for (i = 0; i < nr; i++) {
+		bh = sbi->j_commit[i];
+		jbh = sb_getblk(sb, sbi->j_first + 1 + i);
+		if (!jbh) {
+			ouichefs_journal_wait(sbi->j_log, i);
+			return -ENOMEM;
+		}
+		lock_buffer(jbh);
+		lock_buffer(bh);
+		memcpy(jbh->b_data, bh->b_data, OUICHEFS_BLOCK_SIZE);
+		unlock_buffer(bh);
+		crc = crc32_le(crc, jbh->b_data, OUICHEFS_BLOCK_SIZE);
+		set_buffer_uptodate(jbh);
+		ouichefs_journal_submit(jbh, 0);
+		sbi->j_log[i] = jbh;
+	}
+	ret = ouichefs_journal_wait(sbi->j_log, nr);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		uint32_t home = sbi->j_commit[i]->b_blocknr;
+
+		crc = crc32_le(crc, (void *)&home, sizeof(home));
+	}
+	ret = ouichefs_journal_header(sb, seq, nr, crc);
+	if (!ret)
+		sbi->j_seq = seq;
+
+	return ret;
+}
+
+static int __ouichefs_journal_commit(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t i, n, nr;
+	int ret, err;
+
+	ret = ouichefs_journal_ordered(sb);
+	err = ouichefs_journal_sb_info(sb);
+	if (!ret)
+		ret = err;
+
+	/* close the transaction, no handle can change it past this point */
+	spin_lock(&sbi->j_lock);
+	swap(sbi->j_bhs, sbi->j_commit);
+	nr = sbi->j_nr;
+	sbi->j_nr = 0;
+	sbi->j_extra = 0;
+	for (i = 0; i < nr; i++)
+		clear_buffer_journaled(sbi->j_commit[i]);
+	spin_unlock(&sbi->j_lock);
+
+	/*
+	 * The blocks it freed are left out: a replay must not write them back,
+	 * they may hold file data by then.
+	 */
+	for (i = 0, n = 0; i < nr; i++) {
+		bh = sbi->j_commit[i];
+		if (test_bit(bh->b_blocknr, sbi->bfree_bitmap))
+			put_bh(bh);
+		else
+			sbi->j_commit[n++] = bh;
+	}
+	nr = n;
+
+	/* the data first, and the checkpoint of the previous transaction */
+	err = sync_blockdev(sb->s_bdev);
+	if (!nr)
+		return ret ? ret : err;
+	if (!err)
+		err = blkdev_issue_flush(sb->s_bdev);
+	if (!err)
+		err = ouichefs_journal_log(sb, nr);
+	if (err)
+		pr_err("cannot log transaction %u (%d), writing it in place\n",
+		       sbi->j_seq + 1, err);
+
+	/* checkpoint */
+	for (i = 0; i < nr; i++) {
+		bh = sbi->j_commit[i];
+		lock_buffer(bh);
+		ouichefs_journal_submit(bh, 0);
+	}
+	if (ouichefs_journal_wait(sbi->j_commit, nr) && !err)
+		err = -EIO;
+
+	return ret ? ret : err;
+}
+
+/*
+ * Commit the running transaction and wait for it to be on disk.
+ */
+int ouichefs_journal_commit(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int nofs;
+	void *journal_info;
+	int ret;
+
+	if (sb_rdonly(sb))
+		return 0;
+	/* the handle would keep the commit waiting forever */
+	if (WARN_ON_ONCE(current->journal_info == sbi))
+		return -EDEADLK;
+
+	down_write(&sbi->j_sem);
+	nofs = memalloc_nofs_save();
+	/* the writeback of ordered data nests its handles in the commit */
+	journal_info = current->journal_info;
+	current->journal_info = sbi;
+	ret = __ouichefs_journal_commit(sb);
+	current->journal_info = journal_info;
+	memalloc_nofs_restore(nofs);
+	up_write(&sbi->j_sem);
+
+	return ret;
+}
+
+/*
+ * Return true if an operation that failed with err should be tried again. The
+ * blocks freed by the running transaction are only free once it is committed,
+ * and an operation may not have found room for its blocks in the transaction:
+ * when it ran out of space with a transaction running, the transaction is
+ * committed and the operation retried, once. Never in a handle, which would
+ * hold the commit back.
+ */
+bool ouichefs_journal_retry(struct super_block *sb, int err, int *retries)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (err != -ENOSPC || (*retries)++ ||
+	    (!sbi->nr_pending_blocks && !READ_ONCE(sbi->j_nr) &&
+	     !READ_ONCE(sbi->j_extra)) ||
+	    current->journal_info == sbi)
+		return false;
+
+	return !ouichefs_journal_commit(sb);
+}
+
+/*
+ * Replay the last committed transaction, if its header and checksum are valid,
+ * by writing its blocks in place again.
+ */
+static int ouichefs_journal_replay(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal_header *header;
+	struct buffer_head *hbh, *jbh, *bh;
+	uint32_t i, nr, crc, home;
+	int ret = 0;
+
+	hbh = sb_bread(sb, sbi->j_first);
+	if (!hbh)
+		return -EIO;
+	header = (struct ouichefs_journal_header *)hbh->b_data;
+
+	/* journal fresh from mkfs */
+	if (header->magic != OUICHEFS_JOURNAL_MAGIC)
+		goto release;
+	sbi->j_seq = header->seq;
+	nr = header->nr_blocks;
+	if (!nr)
+		goto release;
+	if (nr > sbi->j_max) {
+		pr_err("journal header corrupted\n");
+		ret = -EINVAL;
+		goto release;
+	}
+
+	crc = header->seq;
+	for (i = 0; i < nr; i++) {
+		jbh = sb_bread(sb, sbi->j_first + 1 + i);
+		if (!jbh) {
+			ret = -EIO;
+			goto release;
+		}
+		crc = crc32_le(crc, jbh->b_data, OUICHEFS_BLOCK_SIZE);
+		brelse(jbh);
+	}
+	crc = crc32_le(crc, (void *)header->blocks, nr * sizeof(uint32_t));
+	if (crc != header->checksum) {
+		pr_info("transaction %u was not fully logged, skipped\n",
+			header->seq);
+		goto release;
+	}
+
+	if (bdev_read_only(sb->s_bdev)) {
+		pr_err("cannot replay the journal on a read-only device\n");
+		ret = -EROFS;
+		goto release;
+	}
+	for (i = 0; i < nr; i++) {
+		home = header->blocks[i];
+		if (home >= sbi->nr_blocks ||
+		    (home >= sbi->j_first &&
+		     home < sbi->j_first + sbi->nr_journal_blocks)) {
+			pr_err("journal header corrupted\n");
+			ret = -EINVAL;
+			goto release;
+		}
+		jbh = sb_bread(sb, sbi->j_first + 1 + i);
+		bh = sb_getblk(sb, home);
+		if (!jbh || !bh) {
+			brelse(jbh);
+			brelse(bh);
+			ret = -EIO;
+			goto release;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, jbh->b_data, OUICHEFS_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		brelse(jbh);
+	}
+	ret = sync_blockdev(sb->s_bdev);
+	if (!ret)
+		pr_info("replayed transaction %u (%u blocks)\n", header->seq,
+			nr);
+
+release:
+	brelse(hbh);
+
+	return ret;
+}
+
+/*
+ * Set up the journal of the partition at mount, replaying what it holds.
+ * The layout fields of the superblock must be set.
+ */
+int ouichefs_journal_load(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t nr_maps = sbi->nr_ifree_blocks + sbi->nr_bfree_blocks +
+			   sbi->nr_bref_blocks;
+	int ret;
+
+	sbi->j_first = sbi->nr_istore_blocks + nr_maps + 1;
+	/* a transaction must have room for the credits of a handle */
+	if (sbi->nr_journal_blocks < OUICHEFS_JOURNAL_CREDITS + 2 ||
+	    sbi->j_first + sbi->nr_journal_blocks >= sbi->nr_blocks) {
+		pr_err("Invalid journal size %u\n", sbi->nr_journal_blocks);
+		return -EINVAL;
+	}
+	sbi->j_max = min_t(uint32_t, sbi->nr_journal_blocks - 1,
+			   OUICHEFS_JOURNAL_SLOTS);
+	init_rwsem(&sbi->j_sem);
+	spin_lock_init(&sbi->j_lock);
+	INIT_LIST_HEAD(&sbi->j_inodes);
+
+	sbi->j_bhs = kcalloc(sbi->j_max, sizeof(*sbi->j_bhs), GFP_KERNEL);
+	sbi->j_commit = kcalloc(sbi->j_max, sizeof(*sbi->j_commit), GFP_KERNEL);
+	sbi->j_log = kcalloc(sbi->j_max, sizeof(*sbi->j_log), GFP_KERNEL);
+	sbi->j_map = bitmap_zalloc(nr_maps, GFP_KERNEL);
+	if (!sbi->j_bhs || !sbi->j_commit || !sbi->j_log || !sbi->j_map) {
+		ret = -ENOMEM;
+		goto destroy;
+	}
+
+	ret = ouichefs_journal_replay(sb);
+	if (ret)
+		goto destroy;
+
+	return 0;
+
+destroy:
+	ouichefs_journal_destroy(sb);
+
+	return ret;
+}
+
+/* Drop the running transaction, if any, and free the journal */
+void ouichefs_journal_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t i;
+
+	for (i = 0; i < sbi->j_nr; i++) {
+		clear_buffer_journaled(sbi->j_bhs[i]);
+		put_bh(sbi->j_bhs[i]);
+	}
+	sbi->j_nr = 0;
+	kfree(sbi->j_bhs);
+	kfree(sbi->j_commit);
+	kfree(sbi->j_log);
+	bitmap_free(sbi->j_map);
+}
+
+/*
+ * Commit what is left at unmount and mark the journal empty, so that the next
+ * mount has nothing to replay.
+ */
+void ouichefs_journal_release(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!sb_rdonly(sb) && !ouichefs_journal_commit(sb))
+		ouichefs_journal_header(sb, sbi->j_seq, 0, 0);
+	ouichefs_journal_destroy(sb);
+}
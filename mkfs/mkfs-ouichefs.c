@@ -10,30 +10,37 @@
 #include <string.h>
 
 #define OUICHEFS_MAGIC 0x48434957
+#define OUICHEFS_VERSION 7 /* On-disk format revision */
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
 #define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
-#define OUICHEFS_FILENAME_LEN 28
-#define OUICHEFS_MAX_SUBFILES 128
 
+/* Journal size bounds: a header block plus up to 1020 logged blocks */
+#define OUICHEFS_JOURNAL_MIN_BLOCKS 32
+#define OUICHEFS_JOURNAL_MAX_BLOCKS 1021
+
+/* 64 bytes without padding, nanoseconds in the low 30 bits of their field */
 struct ouichefs_inode {
-	mode_t i_mode; /* File mode */
+	uint16_t i_mode; /* File mode */
+	uint16_t i_flags; /* ouiche_fs inode flags (I/O engine of the file) */
 	uint32_t i_uid; /* Owner id */
 	uint32_t i_gid; /* Group id */
 	uint32_t i_size; /* Size in bytes */
-	uint32_t i_ctime; /* Inode change time (sec)*/
-	uint64_t i_nctime; /* Inode change time (nsec) */
-	uint32_t i_atime; /* Access time (sec) */
-	uint64_t i_natime; /* Access time (nsec) */
-	uint32_t i_mtime; /* Modification time (sec) */
-	uint64_t i_nmtime; /* Modification time (nsec) */
-	uint32_t i_blocks; /* Block count (subdir count for directories) */
+	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_nctime; /* Inode change time (nsec) */
+	uint32_t i_natime; /* Access time (nsec) */
+	uint32_t i_nmtime; /* Modification time (nsec) */
+	uint64_t i_ctime; /* Inode change time (sec) */
+	uint64_t i_atime; /* Access time (sec) */
+	uint64_t i_mtime; /* Modification time (sec) */
 };
 
+_Static_assert(sizeof(struct ouichefs_inode) == 64, "packed inode");
+
 #define OUICHEFS_INODES_PER_BLOCK \
 	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
 
@@ -50,18 +57,31 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	char padding[4064]; /* Padding to match block size */
+	uint32_t nr_bref_blocks; /* Number of block refcount map blocks */
+
+	uint32_t version; /* On-disk format revision */
+	uint32_t nr_journal_blocks; /* Number of journal blocks */
+
+	char padding[4052]; /* Padding to match block size */
 };
 
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+struct ouichefs_dir_index {
+	uint32_t depth;
+	uint32_t nr_files;
+	uint32_t blocks[(OUICHEFS_BLOCK_SIZE >> 2) - 2];
+};
+
 struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+	uint16_t nr_entries;
+	uint16_t nr_files;
+	uint16_t heap_size;
+	uint16_t dead_size;
+	uint8_t depth;
+	uint8_t reserved[3];
 };
 
 static inline void usage(char *appname)
@@ -87,6 +107,7 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	struct ouichefs_superblock *sb;
 	uint32_t nr_inodes = 0, nr_blocks = 0, nr_ifree_blocks = 0;
 	uint32_t nr_bfree_blocks = 0, nr_data_blocks = 0, nr_istore_blocks = 0;
+	uint32_t nr_bref_blocks = 0, nr_journal_blocks = 0;
 	uint32_t mod;
 
 	sb = malloc(sizeof(struct ouichefs_superblock));
@@ -101,8 +122,14 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
 	nr_ifree_blocks = idiv_ceil(nr_inodes, OUICHEFS_BLOCK_SIZE * 8);
 	nr_bfree_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE * 8);
+	nr_bref_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE);
+	nr_journal_blocks = nr_blocks / 32;
+	if (nr_journal_blocks < OUICHEFS_JOURNAL_MIN_BLOCKS)
+		nr_journal_blocks = OUICHEFS_JOURNAL_MIN_BLOCKS;
+	if (nr_journal_blocks > OUICHEFS_JOURNAL_MAX_BLOCKS)
+		nr_journal_blocks = OUICHEFS_JOURNAL_MAX_BLOCKS;
 	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks -
-			 nr_bfree_blocks;
+			 nr_bfree_blocks - nr_bref_blocks - nr_journal_blocks;
 
 	memset(sb, 0, sizeof(struct ouichefs_superblock));
 	sb->magic = htole32(OUICHEFS_MAGIC);
@@ -111,6 +138,9 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_istore_blocks = htole32(nr_istore_blocks);
 	sb->nr_ifree_blocks = htole32(nr_ifree_blocks);
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
+	sb->nr_bref_blocks = htole32(nr_bref_blocks);
+	sb->version = htole32(OUICHEFS_VERSION);
+	sb->nr_journal_blocks = htole32(nr_journal_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
 
@@ -122,15 +152,20 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 
 	printf("Superblock: (%ld)\n"
 	       "\tmagic=%#x\n"
+	       "\tversion=%u\n"
 	       "\tnr_blocks=%u\n"
 	       "\tnr_inodes=%u (istore=%u blocks)\n"
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
+	       "\tnr_bref_blocks=%u\n"
+	       "\tnr_journal_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
 	       "\tnr_free_blocks=%u\n",
-	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
+	       sizeof(struct ouichefs_superblock), sb->magic, sb->version,
+	       sb->nr_blocks,
 	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
-	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks);
+	       sb->nr_bfree_blocks, sb->nr_bref_blocks, sb->nr_journal_blocks,
+	       sb->nr_free_inodes, sb->nr_free_blocks);
 
 	return sb;
 }
@@ -152,16 +187,18 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	/* Root inode (inode 1) */
 	inode = (struct ouichefs_inode *)block + 1;
 	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
+			   le32toh(sb->nr_bref_blocks) +
+			   le32toh(sb->nr_journal_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
 			   le32toh(sb->nr_istore_blocks);
 	inode->i_mode =
-		htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
+		htole16(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
 			S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
 	inode->i_uid = 0;
 	inode->i_gid = 0;
 	inode->i_size = htole32(OUICHEFS_BLOCK_SIZE);
-	inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
-	inode->i_nctime = inode->i_natime = inode->i_nmtime = htole64(0);
+	inode->i_ctime = inode->i_atime = inode->i_mtime = htole64(0);
+	inode->i_nctime = inode->i_natime = inode->i_nmtime = htole32(0);
 	inode->i_blocks = htole32(1);
 	inode->i_nlink = htole32(2);
 	inode->index_block = htole32(first_data_block);
@@ -242,7 +279,9 @@ static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
 	uint64_t *bfree, mask, line;
 	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
-			   le32toh(sb->nr_bfree_blocks) + 2;
+			   le32toh(sb->nr_bfree_blocks) +
+			   le32toh(sb->nr_bref_blocks) +
+			   le32toh(sb->nr_journal_blocks) + 2;
 
 	block = malloc(OUICHEFS_BLOCK_SIZE);
 	if (!block)
@@ -250,7 +289,8 @@ static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
 	bfree = (uint64_t *)block;
 
 	/*
-	 * First blocks (incl. sb + istore + ifree + bfree + 1 used block)
+	 * First blocks (incl. sb + istore + ifree + bfree + bref + journal + 1
+	 * used block)
 	 * we suppose it won't go further than the first block
 	 */
 	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
@@ -290,6 +330,62 @@ end:
 	return ret;
 }
 
+static int write_bref_blocks(int fd, struct ouichefs_superblock *sb)
+{
+	int ret = 0;
+	uint32_t i;
+	char *block;
+
+	block = malloc(OUICHEFS_BLOCK_SIZE);
+	if (!block)
+		return -1;
+
+	/* No block is shared yet */
+	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	for (i = 0; i < le32toh(sb->nr_bref_blocks); i++) {
+		ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
+		if (ret != OUICHEFS_BLOCK_SIZE) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Bref blocks: wrote %d blocks\n", i);
+end:
+	free(block);
+
+	return ret;
+}
+
+static int write_journal_blocks(int fd, struct ouichefs_superblock *sb)
+{
+	int ret = 0;
+	uint32_t i;
+	char *block;
+
+	block = malloc(OUICHEFS_BLOCK_SIZE);
+	if (!block)
+		return -1;
+
+	/* An empty journal: no header magic, nothing to replay */
+	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	for (i = 0; i < le32toh(sb->nr_journal_blocks); i++) {
+		ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
+		if (ret != OUICHEFS_BLOCK_SIZE) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Journal: wrote %d blocks\n", i);
+end:
+	free(block);
+
+	return ret;
+}
+
 static int write_root_index_block(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0;
@@ -403,6 +499,22 @@ int main(int argc, char **argv)
 		goto free_sb;
 	}
 
+	/* Write block refcount map blocks */
+	ret = write_bref_blocks(fd, sb);
+	if (ret != 0) {
+		perror("write_bref_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write the journal blocks */
+	ret = write_journal_blocks(fd, sb);
+	if (ret != 0) {
+		perror("write_journal_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
 	/* Write the root index block */
 	ret = write_root_index_block(fd, sb);
 	if (ret != 0) {
@@ -8,17 +8,26 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/fs_parser.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "ioctl.h"
 
 #define OUICHEFS_MAGIC 0x48434957
+#define OUICHEFS_VERSION 7 /* On-disk format revision written by mkfs */
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
 #define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
-#define OUICHEFS_FILENAME_LEN 28
-#define OUICHEFS_MAX_SUBFILES 128
+#define OUICHEFS_FILENAME_LEN 255
 #define BLOCK_NUMBER_MASK 0x000FFFFF  // Mask for the lower 20 bits
 #define BLOCK_SIZE_MASK 0xFFF00000    // Mask for the upper 12 bits
+#define OUICHEFS_WCB_SIZE 512 /* Write-combining buffer for small writes */
 
 
 /*
@@ -33,30 +42,81 @@
  * +---------------+
  * | bfree bitmap  |  sb->nr_bfree_blocks blocks
  * +---------------+
+ * | bref map      |  sb->nr_bref_blocks blocks
+ * +---------------+
+ * |   journal     |  sb->nr_journal_blocks blocks
+ * +---------------+
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
  *
  */
 
+/*
+ * On-disk inode, 64 bytes without any padding: every field is aligned on its
+ * size. Timestamps are 64-bit seconds and nanoseconds kept in the low 30 bits
+ * of a 32-bit field, whose upper bits are zero.
+ */
 struct ouichefs_inode {
-	uint32_t i_mode; /* File mode */
+	uint16_t i_mode; /* File mode */
+	uint16_t i_flags; /* ouiche_fs inode flags (OUICHEFS_INODE_*) */
 	uint32_t i_uid; /* Owner id */
 	uint32_t i_gid; /* Group id */
 	uint32_t i_size; /* Size in bytes */
-	uint32_t i_ctime; /* Inode change time (sec)*/
-	uint64_t i_nctime; /* Inode change time (nsec) */
-	uint32_t i_atime; /* Access time (sec) */
-	uint64_t i_natime; /* Access time (nsec) */
-	uint32_t i_mtime; /* Modification time (sec) */
-	uint64_t i_nmtime; /* Modification time (nsec) */
 	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_nctime; /* Inode change time (nsec) */
+	uint32_t i_natime; /* Access time (nsec) */
+	uint32_t i_nmtime; /* Modification time (nsec) */
+	uint64_t i_ctime; /* Inode change time (sec) */
+	uint64_t i_atime; /* Access time (sec) */
+	uint64_t i_mtime; /* Modification time (sec) */
+};
+
+static_assert(sizeof(struct ouichefs_inode) == 64);
+
+#define OUICHEFS_NSEC_MASK ((1U << 30) - 1) /* 30 bits hold 999999999 */
+
+/* The low bits of i_flags hold the I/O engine owning a regular file */
+#define OUICHEFS_INODE_ENGINE_MASK 0x3
+/* The next ones the algorithm compressing a page-cache file (OUICHEFS_COMPRESS_*) */
+#define OUICHEFS_INODE_COMPR_SHIFT 2
+#define OUICHEFS_INODE_COMPR_MASK (0x3 << OUICHEFS_INODE_COMPR_SHIFT)
+
+/*
+ * Small writes staged in memory until they are merged into the blocks of the
+ * file (see ouichefs_commit() in the variable-size block engine).
+ */
+struct ouichefs_wcb {
+	loff_t pos; /* File offset of the first staged byte */
+	size_t len; /* Number of staged bytes */
+	char data[OUICHEFS_WCB_SIZE];
+};
+
+/*
+ * Transforms of a compression algorithm, with their buffers, shared by the
+ * compressions and decompressions of a mount (see ouichefs_compr_get()).
+ */
+struct ouichefs_compr_pool {
+	spinlock_t lock; /* Protects idle and nr */
+	struct list_head idle; /* Transforms not in use */
+	unsigned int nr; /* Transforms allocated */
+	wait_queue_head_t wait; /* For a transform to become idle */
 };
 
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	uint32_t i_flags;
+	struct mutex wcb_lock; /* Protects wcb and the index block on write */
+	struct ouichefs_wcb *wcb; /* Staged small writes, NULL if never used */
+	uint32_t nr_splits; /* Blocks split by writes since inode was loaded */
+	bool tail_valid; /* tail_nr and tail_end are up to date */
+	uint32_t tail_nr; /* Used index entries of a variable-size block file */
+	loff_t tail_end; /* Bytes stored in these index entries */
+	struct list_head j_list; /* In j_inodes, written back by the commit */
+	unsigned int nr_opens; /* Open files of a regular file, under i_lock */
+	struct ouichefs_dir_cache __rcu *dir_cache; /* Names of a directory */
 	struct inode vfs_inode;
 };
 
@@ -76,23 +136,194 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
+	uint32_t nr_bref_blocks; /* Number of block refcount map blocks */
+
+	uint32_t version; /* On-disk format revision (OUICHEFS_VERSION) */
+
+	uint32_t nr_journal_blocks; /* Number of journal blocks */
+
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	uint8_t *bref_map; /* In-memory block refcount map, NULL if none */
+	unsigned long *bfree_pending; /* Blocks freed since the last commit */
+	uint32_t nr_pending_blocks; /* Number of blocks in bfree_pending */
+	spinlock_t bitmap_lock; /* Protects the maps, their counters, index_goal */
+
+	/* Mount options, see ouichefs_fs_parameters */
+	uint32_t engine; /* I/O engine of new files */
+	uint32_t alloc; /* Allocator policy (OUICHEFS_ALLOC_*) */
+	uint32_t index_reserve; /* Blocks left free after a new index block */
+	uint32_t commit_interval; /* Seconds between metadata syncs, or 0 */
+	uint32_t dir_cache_max; /* Files of the largest directory name cache */
+	bool dir_readahead; /* readdir reads the inodes of the files ahead */
+
+	uint32_t index_goal; /* Where to look for the index of a new file */
+	struct super_block *sb;
+	struct delayed_work sync_work; /* Commit every commit_interval */
+
+	/* Metadata journal, see journal.c */
+	struct rw_semaphore j_sem; /* Read by handles, written by commits */
+	spinlock_t j_lock; /* Protects j_bhs, j_nr, the credits and j_inodes */
+	struct buffer_head **j_bhs; /* Buffers of the running transaction */
+	struct buffer_head **j_commit; /* Buffers of the committing one */
+	struct buffer_head **j_log; /* Their copies in the journal */
+	uint32_t j_nr; /* Buffers in j_bhs */
+	uint32_t j_max; /* Most buffers a transaction can hold */
+	uint32_t j_reserved; /* Credits of the running handles */
+	uint32_t j_extra; /* Credits held until the commit */
+	unsigned long *j_map; /* Bitmap blocks it changes, under bitmap_lock */
+	uint32_t j_map_nr; /* Bits set in j_map */
+	uint32_t j_first; /* First block of the journal, its header */
+	uint32_t j_seq; /* Sequence number of the last transaction */
+	struct list_head j_inodes; /* Files whose data it writes first */
+
+	struct ouichefs_compr_pool compr_pools[OUICHEFS_COMPRESS_ZSTD + 1];
 };
 
+/* Allocator policies */
+#define OUICHEFS_ALLOC_GOAL 0 /* Near the parent directory or index block */
+#define OUICHEFS_ALLOC_FIRST 1 /* First free inode or block */
+
+/* Defaults of the mount options */
+#define OUICHEFS_COMMIT_INTERVAL 5
+#define OUICHEFS_INDEX_RESERVE 8
+#define OUICHEFS_INDEX_RESERVE_MAX 1023
+#define OUICHEFS_DIR_CACHE_MAX 65536
+
+/*
+ * Index block of a regular file. An entry without a block number is a hole,
+ * which reads as zeros. The page-cache and direct engines map the i-th 4 KiB of
+ * the file with the i-th entry. The variable-size block engine maps the file
+ * with consecutive entries, each holding as many bytes as its 12-bit size, be
+ * they stored in a block or a hole.
+ */
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+/*
+ * Header of the journal, in its first block. The nr_blocks blocks after it hold
+ * the copies of the metadata blocks of the last committed transaction, whose
+ * home block numbers are in blocks[]. The checksum covers both, so that a
+ * transaction whose commit was cut short is not replayed.
+ */
+#define OUICHEFS_JOURNAL_MAGIC 0x4c4e524a /* "JRNL" */
+#define OUICHEFS_JOURNAL_SLOTS ((OUICHEFS_BLOCK_SIZE >> 2) - 4)
+#define OUICHEFS_JOURNAL_CREDITS 16 /* Blocks a handle may add to it */
+
+struct ouichefs_journal_header {
+	uint32_t magic;
+	uint32_t seq; /* Sequence number of the transaction */
+	uint32_t nr_blocks; /* Blocks of the transaction, 0 if none */
+	uint32_t checksum; /* crc32 of the blocks, then of blocks[] */
+	uint32_t blocks[OUICHEFS_JOURNAL_SLOTS]; /* Home of each block */
+};
+
+/*
+ * The block refcount map holds one byte per block: the number of files that
+ * share it through a clone, besides the first one. 0 for most blocks.
+ */
+#define OUICHEFS_BREF_MAX 255
+
+/*
+ * A compressed file is stored by clusters of OUICHEFS_CLUSTER_BLOCKS blocks. In
+ * the index block, OUICHEFS_COMPR_ADDR marks a compressed cluster and is not a
+ * block number (see file_compress.c).
+ */
+#define OUICHEFS_CLUSTER_BLOCKS 4
+#define OUICHEFS_CLUSTER_SIZE (OUICHEFS_CLUSTER_BLOCKS * OUICHEFS_BLOCK_SIZE)
+#define OUICHEFS_COMPR_ADDR 0xFFFFFFFF
+
+/*
+ * Directories are extendible hash tables. The index block of a directory holds
+ * its global depth G and the pointer blocks of a table of 2^G leaf block
+ * numbers: the leaf holding a name is the one at the G high bits of its hash.
+ * A leaf of local depth L holds all the names whose hash starts with the same
+ * L bits, and is pointed to by 2^(G - L) consecutive table entries. A full leaf
+ * is split in two, doubling the table first if L == G. An all-zero index block
+ * is an empty directory without any leaf yet.
+ */
+#define OUICHEFS_DIR_PTRS (OUICHEFS_BLOCK_SIZE >> 2) /* Per pointer block */
+#define OUICHEFS_DIR_INDEX_PTRS ((OUICHEFS_BLOCK_SIZE >> 2) - 2)
+#define OUICHEFS_DIR_MAX_DEPTH 19 /* 2^19 leaves in 512 pointer blocks */
+
+struct ouichefs_dir_index {
+	uint32_t depth; /* Global depth */
+	uint32_t nr_files; /* Files in the whole directory */
+	uint32_t blocks[OUICHEFS_DIR_INDEX_PTRS]; /* Pointer blocks */
+};
+
+/*
+ * Directory leaf. The header is followed by a table of the files of the leaf
+ * sorted by name hash, so that a name is looked up by binary search. Each
+ * table entry locates the record of a file, with its variable-length name, in
+ * a heap growing down from the end of the block. Removing a file leaves a
+ * tombstone in the table, which keeps its hash so that the table stays sorted
+ * and can be reused by a file whose hash fits there. Tombstones and records of
+ * removed files stay until the room is needed, and the leaf is then compacted.
+ */
+struct ouichefs_dir_entry {
+	uint32_t hash; /* ouichefs_name_hash() of the name of the file */
+	uint16_t offset; /* Of the record in the leaf, 0 for a tombstone */
+	uint16_t size; /* Of the record, OUICHEFS_FILE_SIZE() of its name */
+};
+
+struct ouichefs_file {
+	uint32_t inode;
+	uint8_t name_len;
+	uint8_t file_type; /* FT_*, FT_UNKNOWN in older records */
+	char filename[]; /* Not NUL-terminated */
+};
+
+#define OUICHEFS_FILE_SIZE(len) \
+	ALIGN(offsetof(struct ouichefs_file, filename) + (len), 4)
+
 struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+	uint16_t nr_entries; /* Entries of the table, tombstones included */
+	uint16_t nr_files; /* Entries of the table that are not tombstones */
+	uint16_t heap_size; /* Bytes of the heap */
+	uint16_t dead_size; /* Bytes of tombstones and removed records */
+	uint8_t depth; /* Local depth */
+	uint8_t reserved[3];
+	struct ouichefs_dir_entry entries[];
 };
 
 /* superblock functions */
-int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
+int ouichefs_init_fs_context(struct fs_context *fc);
+extern const struct fs_parameter_spec ouichefs_fs_parameters[];
+
+/* journal functions */
+struct ouichefs_handle {
+	bool started; /* False when nested in a handle of the same task */
+	unsigned int nofs; /* Allocation scope to restore when it stops */
+};
+
+int ouichefs_journal_load(struct super_block *sb);
+void ouichefs_journal_release(struct super_block *sb);
+void ouichefs_journal_destroy(struct super_block *sb);
+void ouichefs_journal_start(struct super_block *sb,
+			    struct ouichefs_handle *handle);
+void ouichefs_journal_stop(struct super_block *sb,
+			   struct ouichefs_handle *handle);
+int ouichefs_journal_extend(struct super_block *sb, uint32_t nr);
+void ouichefs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+void ouichefs_journal_add_inode(struct inode *inode);
+void ouichefs_journal_forget_inode(struct inode *inode);
+int ouichefs_journal_commit(struct super_block *sb);
+bool ouichefs_journal_retry(struct super_block *sb, int err, int *retries);
+
+/* directory functions */
+uint32_t ouichefs_name_hash(const char *name, unsigned int len);
+int ouichefs_dir_lookup(struct inode *dir, const struct qstr *name,
+			uint32_t *ino);
+int ouichefs_dir_add(struct inode *dir, const struct qstr *name,
+		     struct inode *inode);
+int ouichefs_dir_remove(struct inode *dir, const struct qstr *name);
+int ouichefs_dir_is_empty(struct inode *dir);
+void ouichefs_dir_put_blocks(struct inode *dir);
+void ouichefs_dir_cache_release(struct inode *dir);
+int ouichefs_init_dir_cache(void);
+void ouichefs_destroy_dir_cache(void);
 
 /* inode functions */
 int ouichefs_init_inode_cache(void);
@@ -100,9 +331,48 @@ void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
 
 /* file functions */
+uint32_t ouichefs_file_engine(struct inode *inode);
+uint32_t ouichefs_entry_mask(struct inode *inode);
+void ouichefs_set_file_ops(struct inode *inode);
+int ouichefs_truncate(struct inode *inode, loff_t size);
+int ouichefs_varblock_truncate(struct inode *inode, loff_t size);
+int ouichefs_flush_wcb(struct inode *inode);
+int ouichefs_zero_block(struct super_block *sb, uint32_t bno, size_t from,
+			size_t to);
+struct buffer_head *ouichefs_new_block(struct super_block *sb, uint32_t bno);
+int ouichefs_alloc_index(struct inode *inode);
+int ouichefs_varblock_punch(struct inode *inode, loff_t start, loff_t end);
+long ouichefs_fallocate(struct file *file, int mode, loff_t offset,
+			loff_t len);
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+loff_t ouichefs_remap_file_range(struct file *file_in, loff_t pos_in,
+				 struct file *file_out, loff_t pos_out,
+				 loff_t len, unsigned int remap_flags);
+loff_t ouichefs_llseek(struct file *file, loff_t offset, int whence);
+loff_t ouichefs_varblock_seek_hole_data(struct inode *inode, loff_t offset,
+					int whence);
+int ouichefs_file_open(struct inode *inode, struct file *file);
+int ouichefs_file_release(struct inode *inode, struct file *file);
+long ouichefs_engine_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg);
+uint32_t ouichefs_file_compress(struct inode *inode);
+int ouichefs_compr_truncate(struct inode *inode, loff_t size);
+void ouichefs_compr_init(struct ouichefs_sb_info *sbi);
+void ouichefs_compr_cleanup(struct ouichefs_sb_info *sbi);
 extern const struct file_operations ouichefs_file_ops;
+extern const struct file_operations ouichefs_direct_file_ops;
+extern const struct file_operations ouichefs_varblock_file_ops;
+extern const struct file_operations ouichefs_compr_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
+extern const struct address_space_operations ouichefs_varblock_aops;
+extern const struct address_space_operations ouichefs_compr_aops;
+
+/* Return true if the len bytes at addr are all zeros, scanning word by word */
+static inline bool ouichefs_is_zero(const void *addr, size_t len)
+{
+	return !memchr_inv(addr, 0, len);
+}
 
 /* Getters for superbock and inode */
 #define OUICHEFS_SB(sb) (sb->s_fs_info)
@@ -9,9 +9,12 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/fs_context.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/seq_file.h>
 
 #include "ouichefs.h"
 
@@ -40,6 +43,13 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	ci = kmem_cache_alloc(ouichefs_inode_cache, GFP_KERNEL);
 	if (!ci)
 		return NULL;
+	mutex_init(&ci->wcb_lock);
+	ci->wcb = NULL;
+	ci->nr_splits = 0;
+	ci->tail_valid = false;
+	INIT_LIST_HEAD(&ci->j_list);
+	ci->nr_opens = 0;
+	RCU_INIT_POINTER(ci->dir_cache, NULL);
 	inode_init_once(&ci->vfs_inode);
 	return &ci->vfs_inode;
 }
@@ -49,27 +59,42 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	ouichefs_journal_forget_inode(inode);
+	kfree(ci->wcb);
+	ouichefs_dir_cache_release(inode);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
-static int ouichefs_write_inode(struct inode *inode,
-				struct writeback_control *wbc)
+/*
+ * Copy inode into its inode store block, which joins the running transaction.
+ * Called by mark_inode_dirty(), and for the timestamps of lazytime only when
+ * the inode is written. The copy is made in a handle, nested in the one of the
+ * caller if any, so that it never lands in a transaction being committed: its
+ * checkpoint would write the inode of the next one in place. Callers must not
+ * hold the wcb or page locks outside of a handle, which come after it.
+ */
+static void ouichefs_dirty_inode(struct inode *inode, int flags)
 {
 	struct ouichefs_inode *disk_inode;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_handle handle;
 	struct buffer_head *bh;
 	uint32_t ino = inode->i_ino;
 	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
 	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
 
 	if (ino >= sbi->nr_inodes)
-		return 0;
+		return;
 
+	ouichefs_journal_start(sb, &handle);
 	bh = sb_bread(sb, inode_block);
-	if (!bh)
-		return -EIO;
+	if (!bh) {
+		pr_err("cannot read the inode store block of inode %u\n", ino);
+		goto stop;
+	}
+	lock_buffer(bh);
 	disk_inode = (struct ouichefs_inode *)bh->b_data;
 	disk_inode += inode_shift;
 
@@ -79,102 +104,35 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_gid = i_gid_read(inode);
 	disk_inode->i_size = inode->i_size;
 	disk_inode->i_ctime = inode->i_ctime.tv_sec;
-	disk_inode->i_nctime = inode->i_ctime.tv_nsec;
+	disk_inode->i_nctime = inode->i_ctime.tv_nsec & OUICHEFS_NSEC_MASK;
 	disk_inode->i_atime = inode->i_atime.tv_sec;
-	disk_inode->i_natime = inode->i_atime.tv_nsec;
+	disk_inode->i_natime = inode->i_atime.tv_nsec & OUICHEFS_NSEC_MASK;
 	disk_inode->i_mtime = inode->i_mtime.tv_sec;
-	disk_inode->i_nmtime = inode->i_mtime.tv_nsec;
+	disk_inode->i_nmtime = inode->i_mtime.tv_nsec & OUICHEFS_NSEC_MASK;
 	disk_inode->i_blocks = inode->i_blocks;
 	disk_inode->i_nlink = inode->i_nlink;
 	disk_inode->index_block = ci->index_block;
+	disk_inode->i_flags = ci->i_flags;
+	unlock_buffer(bh);
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-
-	return 0;
-}
-
-static int sync_sb_info(struct super_block *sb, int wait)
-{
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_sb_info *disk_sb;
-	struct buffer_head *bh;
-
-	/* Flush superblock */
-	bh = sb_bread(sb, 0);
-	if (!bh)
-		return -EIO;
-	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
-
-	disk_sb->nr_blocks = sbi->nr_blocks;
-	disk_sb->nr_inodes = sbi->nr_inodes;
-	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
-	disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
-	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
-
-	mark_buffer_dirty(bh);
-	if (wait)
-		sync_dirty_buffer(bh);
+	ouichefs_journal_dirty(sb, bh);
 	brelse(bh);
-
-	return 0;
+stop:
+	ouichefs_journal_stop(sb, &handle);
 }
 
-static int sync_ifree(struct super_block *sb, int wait)
-{
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
-
-	/* Flush free inodes bitmask */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
-
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
-	}
-
-	return 0;
-}
-
-static int sync_bfree(struct super_block *sb, int wait)
+/*
+ * The inode is already in the running transaction (ouichefs_dirty_inode()).
+ * fsync() and the like commit it. sync() commits once for all the inodes, in
+ * ouichefs_sync_fs().
+ */
+static int ouichefs_write_inode(struct inode *inode,
+				struct writeback_control *wbc)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
-
-	/* Flush free blocks bitmask */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
-
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
-	}
+	if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+		return 0;
 
-	return 0;
+	return ouichefs_journal_commit(inode->i_sb);
 }
 
 static void ouichefs_put_super(struct super_block *sb)
@@ -182,27 +140,27 @@ static void ouichefs_put_super(struct super_block *sb)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
+		cancel_delayed_work_sync(&sbi->sync_work);
+		ouichefs_journal_release(sb);
 		kfree(sbi->ifree_bitmap);
 		kfree(sbi->bfree_bitmap);
+		kfree(sbi->bfree_pending);
+		kfree(sbi->bref_map);
+		ouichefs_compr_cleanup(sbi);
 		kfree(sbi);
 	}
 }
 
+/*
+ * The data of the files was written by the writeback before, and the metadata
+ * in memory (superblock counters and bitmaps) is logged by the commit.
+ */
 static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
-	int ret = 0;
-
-	ret = sync_sb_info(sb, wait);
-	if (ret)
-		return ret;
-	ret = sync_ifree(sb, wait);
-	if (ret)
-		return ret;
-	ret = sync_bfree(sb, wait);
-	if (ret)
-		return ret;
+	if (!wait)
+		return 0;
 
-	return 0;
+	return ouichefs_journal_commit(sb);
 }
 
 static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
@@ -222,17 +180,165 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	return 0;
 }
 
+static const char *const ouichefs_engine_names[] = {
+	[OUICHEFS_ENGINE_PAGECACHE] = "pagecache",
+	[OUICHEFS_ENGINE_DIRECT] = "direct",
+	[OUICHEFS_ENGINE_VARBLOCK] = "varblock",
+};
+
+static int ouichefs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(root->d_sb);
+
+	seq_printf(m, ",engine=%s", ouichefs_engine_names[sbi->engine]);
+	if (sbi->alloc == OUICHEFS_ALLOC_FIRST)
+		seq_puts(m, ",alloc=first");
+	if (sbi->index_reserve != OUICHEFS_INDEX_RESERVE)
+		seq_printf(m, ",index_reserve=%u", sbi->index_reserve);
+	if (sbi->commit_interval != OUICHEFS_COMMIT_INTERVAL)
+		seq_printf(m, ",commit=%u", sbi->commit_interval);
+	if (sbi->dir_cache_max != OUICHEFS_DIR_CACHE_MAX)
+		seq_printf(m, ",dir_cache_max=%u", sbi->dir_cache_max);
+	if (!sbi->dir_readahead)
+		seq_puts(m, ",nodir_readahead");
+
+	return 0;
+}
+
+/*
+ * Commit the running transaction every commit_interval seconds, so that a crash
+ * loses at most that much of the metadata updates.
+ */
+static void ouichefs_sync_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi = container_of(to_delayed_work(work),
+						    struct ouichefs_sb_info,
+						    sync_work);
+
+	ouichefs_journal_commit(sbi->sb);
+	if (sbi->commit_interval)
+		queue_delayed_work(system_wq, &sbi->sync_work,
+				   sbi->commit_interval * HZ);
+}
+
+enum {
+	Opt_engine,
+	Opt_alloc,
+	Opt_index_reserve,
+	Opt_commit,
+	Opt_dir_cache_max,
+	Opt_dir_readahead,
+};
+
+static const struct constant_table ouichefs_param_engine[] = {
+	{ "pagecache", OUICHEFS_ENGINE_PAGECACHE },
+	{ "direct", OUICHEFS_ENGINE_DIRECT },
+	{ "varblock", OUICHEFS_ENGINE_VARBLOCK },
+	{}
+};
+
+static const struct constant_table ouichefs_param_alloc[] = {
+	{ "goal", OUICHEFS_ALLOC_GOAL },
+	{ "first", OUICHEFS_ALLOC_FIRST },
+	{}
+};
+
+const struct fs_parameter_spec ouichefs_fs_parameters[] = {
+	fsparam_enum("engine", Opt_engine, ouichefs_param_engine),
+	fsparam_enum("alloc", Opt_alloc, ouichefs_param_alloc),
+	fsparam_u32("index_reserve", Opt_index_reserve),
+	fsparam_u32("commit", Opt_commit),
+	fsparam_u32("dir_cache_max", Opt_dir_cache_max),
+	fsparam_flag_no("dir_readahead", Opt_dir_readahead),
+	{}
+};
+
+/*
+ * Mount options parsed from a mount or a remount. Only the ones given (set) are
+ * applied to the superblock, the others keep their default or current value.
+ */
+struct ouichefs_fs_context {
+	unsigned int set; /* BIT(Opt_*) of the options given */
+	uint32_t engine;
+	uint32_t alloc;
+	uint32_t index_reserve;
+	uint32_t commit_interval;
+	uint32_t dir_cache_max;
+	bool dir_readahead;
+};
+
+static int ouichefs_parse_param(struct fs_context *fc,
+				struct fs_parameter *param)
+{
+	struct ouichefs_fs_context *ctx = fc->fs_private;
+	struct fs_parse_result result;
+	int opt;
+
+	opt = fs_parse(fc, ouichefs_fs_parameters, param, &result);
+	if (opt < 0)
+		return opt;
+
+	switch (opt) {
+	case Opt_engine:
+		ctx->engine = result.uint_32;
+		break;
+	case Opt_alloc:
+		ctx->alloc = result.uint_32;
+		break;
+	case Opt_index_reserve:
+		if (result.uint_32 > OUICHEFS_INDEX_RESERVE_MAX)
+			return invalfc(fc, "index_reserve above %u",
+				       OUICHEFS_INDEX_RESERVE_MAX);
+		ctx->index_reserve = result.uint_32;
+		break;
+	case Opt_commit:
+		if (result.uint_32 > INT_MAX / HZ)
+			return invalfc(fc, "commit interval too large");
+		ctx->commit_interval = result.uint_32;
+		break;
+	case Opt_dir_cache_max:
+		ctx->dir_cache_max = result.uint_32;
+		break;
+	case Opt_dir_readahead:
+		ctx->dir_readahead = !result.negated;
+		break;
+	}
+	ctx->set |= BIT(opt);
+
+	return 0;
+}
+
+/* Apply the mount options given in ctx to sbi */
+static void ouichefs_apply_options(struct ouichefs_sb_info *sbi,
+				   struct ouichefs_fs_context *ctx)
+{
+	if (ctx->set & BIT(Opt_engine))
+		sbi->engine = ctx->engine;
+	if (ctx->set & BIT(Opt_alloc))
+		sbi->alloc = ctx->alloc;
+	if (ctx->set & BIT(Opt_index_reserve))
+		sbi->index_reserve = ctx->index_reserve;
+	if (ctx->set & BIT(Opt_commit))
+		sbi->commit_interval = ctx->commit_interval;
+	if (ctx->set & BIT(Opt_dir_cache_max))
+		sbi->dir_cache_max = ctx->dir_cache_max;
+	if (ctx->set & BIT(Opt_dir_readahead))
+		sbi->dir_readahead = ctx->dir_readahead;
+}
+
 static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
+	.dirty_inode = ouichefs_dirty_inode,
 	.write_inode = ouichefs_write_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
+	.show_options = ouichefs_show_options,
 };
 
 /* Fill the struct superblock from partition superblock */
-int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
+static int ouichefs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
 	struct buffer_head *bh = NULL;
 	struct ouichefs_sb_info *csb = NULL;
@@ -260,6 +366,14 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto release;
 	}
 
+	/* Refuse a format revision we would misread */
+	if (csb->version != OUICHEFS_VERSION) {
+		pr_err("Unsupported format revision %u (expected %u), run mkfs again\n",
+		       csb->version, OUICHEFS_VERSION);
+		ret = -EINVAL;
+		goto release;
+	}
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -271,18 +385,40 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_istore_blocks = csb->nr_istore_blocks;
 	sbi->nr_ifree_blocks = csb->nr_ifree_blocks;
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
+	sbi->nr_bref_blocks = csb->nr_bref_blocks;
+	sbi->version = csb->version;
+	sbi->nr_journal_blocks = csb->nr_journal_blocks;
+	spin_lock_init(&sbi->bitmap_lock);
+	ouichefs_compr_init(sbi);
+	sbi->sb = sb;
+	INIT_DELAYED_WORK(&sbi->sync_work, ouichefs_sync_work);
+	sb->s_fs_info = sbi;
+
+	/* Replay the last transaction, before reading what it may update */
+	ret = ouichefs_journal_load(sb);
+	if (ret)
+		goto free_sbi;
 	sbi->nr_free_inodes = csb->nr_free_inodes;
 	sbi->nr_free_blocks = csb->nr_free_blocks;
-	sb->s_fs_info = sbi;
 
 	brelse(bh);
+	bh = NULL;
+
+	/* Mount options, over their defaults */
+	sbi->engine = OUICHEFS_ENGINE_PAGECACHE;
+	sbi->alloc = OUICHEFS_ALLOC_GOAL;
+	sbi->index_reserve = OUICHEFS_INDEX_RESERVE;
+	sbi->commit_interval = OUICHEFS_COMMIT_INTERVAL;
+	sbi->dir_cache_max = OUICHEFS_DIR_CACHE_MAX;
+	sbi->dir_readahead = true;
+	ouichefs_apply_options(sbi, fc->fs_private);
 
 	/* Alloc and copy ifree_bitmap */
 	sbi->ifree_bitmap =
 		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
 	if (!sbi->ifree_bitmap) {
 		ret = -ENOMEM;
-		goto free_sbi;
+		goto free_journal;
 	}
 	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
 		int idx = sbi->nr_istore_blocks + i + 1;
@@ -302,9 +438,11 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	/* Alloc and copy bfree_bitmap */
 	sbi->bfree_bitmap =
 		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->bfree_bitmap) {
+	sbi->bfree_pending =
+		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+	if (!sbi->bfree_bitmap || !sbi->bfree_pending) {
 		ret = -ENOMEM;
-		goto free_ifree;
+		goto free_bfree;
 	}
 	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
 		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
@@ -321,11 +459,37 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		brelse(bh);
 	}
 
+	/* Alloc and copy bref_map, partitions made before it have none */
+	if (sbi->nr_bref_blocks) {
+		sbi->bref_map = kzalloc(sbi->nr_bref_blocks *
+						OUICHEFS_BLOCK_SIZE,
+					GFP_KERNEL);
+		if (!sbi->bref_map) {
+			ret = -ENOMEM;
+			goto free_bfree;
+		}
+	}
+	for (i = 0; i < sbi->nr_bref_blocks; i++) {
+		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+			  sbi->nr_bfree_blocks + i + 1;
+
+		bh = sb_bread(sb, idx);
+		if (!bh) {
+			ret = -EIO;
+			goto free_bref;
+		}
+
+		memcpy((void *)sbi->bref_map + i * OUICHEFS_BLOCK_SIZE,
+		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+
+		brelse(bh);
+	}
+
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto free_bref;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
@@ -334,14 +498,23 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto iput;
 	}
 
+	if (sbi->commit_interval)
+		queue_delayed_work(system_wq, &sbi->sync_work,
+				   sbi->commit_interval * HZ);
+
 	return 0;
 
 iput:
 	iput(root_inode);
+free_bref:
+	kfree(sbi->bref_map);
 free_bfree:
 	kfree(sbi->bfree_bitmap);
+	kfree(sbi->bfree_pending);
 free_ifree:
 	kfree(sbi->ifree_bitmap);
+free_journal:
+	ouichefs_journal_destroy(sb);
 free_sbi:
 	kfree(sbi);
 release:
@@ -349,3 +522,62 @@ release:
 
 	return ret;
 }
+
+/* Mount a ouiche_fs partition */
+static int ouichefs_get_tree(struct fs_context *fc)
+{
+	int ret;
+
+	ret = get_tree_bdev(fc, ouichefs_fill_super);
+	if (ret)
+		pr_err("'%s' mount failure\n", fc->source);
+	else
+		pr_info("'%s' mount success\n", fc->source);
+
+	return ret;
+}
+
+/*
+ * Remount: the options given replace the current ones. They all apply to the
+ * mounted partition right away, engine= to the files created from then on.
+ */
+static int ouichefs_reconfigure(struct fs_context *fc)
+{
+	struct super_block *sb = fc->root->d_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sync_filesystem(sb);
+	ouichefs_apply_options(sbi, fc->fs_private);
+	if (sbi->commit_interval)
+		mod_delayed_work(system_wq, &sbi->sync_work,
+				 sbi->commit_interval * HZ);
+	else
+		cancel_delayed_work_sync(&sbi->sync_work);
+
+	return 0;
+}
+
+static void ouichefs_free_fc(struct fs_context *fc)
+{
+	kfree(fc->fs_private);
+}
+
+static const struct fs_context_operations ouichefs_context_ops = {
+	.free = ouichefs_free_fc,
+	.parse_param = ouichefs_parse_param,
+	.get_tree = ouichefs_get_tree,
+	.reconfigure = ouichefs_reconfigure,
+};
+
+int ouichefs_init_fs_context(struct fs_context *fc)
+{
+	struct ouichefs_fs_context *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	fc->fs_private = ctx;
+	fc->ops = &ouichefs_context_ops;
+
+	return 0;
+}